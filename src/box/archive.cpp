@@ -2,6 +2,10 @@
 
 #include "tbx/streams/memory_buffer.h"
 #include "tbx/streams/data_pipe.h"
+#include "tbx/streams/threaded_data_source.h"
+#include "tbx/streams/spill_buffer.h"
+#include "tbx/streams/crc32_data_writer.h"
+#include "tbx/base/concurrency.h"
 
 using uexc = exceptions::unserialization_exception;
 
@@ -10,7 +14,6 @@ template<typename T> using aref = array_reference<T>;
 
 struct refs
 {
-  ref<box::Header> header;
   aref<box::SectionHeader> sectionTable;
   
   aref<box::Entry> entryTable;
@@ -18,7 +21,75 @@ struct refs
   aref<box::Group> groupTable;
 };
 
-Archive::Archive()
+region_view::region_view(R& r, roff_t offset, size_t length) : _data(r.view(offset, length)), _offset(offset), _length(length)
+{
+  if (!_data && length > 0)
+  {
+    byte* data = new byte[length];
+    _data.reset(data, std::default_delete<byte[]>());
+    r.seek(offset);
+    
+    for (size_t done = 0; done < length; )
+    {
+      size_t effective = r.read(data + done, length - done);
+      
+      if (effective == END_OF_STREAM)
+        throw uexc(fmt::sprintf("archive is truncated, region at %lu of %lu bytes is not complete", offset, length));
+      
+      done += effective;
+    }
+  }
+}
+
+std::string_view region_view::string(size_t offset) const
+{
+  if (offset >= _length)
+    throw uexc(fmt::sprintf("string at %lu is outside of its table", offset));
+  
+  const char* begin = reinterpret_cast<const char*>(_data.get() + offset);
+  const char* end = std::find(begin, reinterpret_cast<const char*>(_data.get() + _length), '\0');
+  
+  if (end == reinterpret_cast<const char*>(_data.get() + _length))
+    throw uexc(fmt::sprintf("string at %lu is not terminated inside its table", offset));
+  
+  return std::string_view(begin, end - begin);
+}
+
+const byte* region_view::data(roff_t offset, size_t length) const
+{
+  if (!contains(offset, length))
+    throw uexc(fmt::sprintf("data at %lu of %lu bytes is outside of its table", offset, length));
+  
+  return _data.get() + (offset - _offset);
+}
+
+void ArchiveEntry::load() const
+{
+  if (!_tables)
+    return;
+  
+  /* entry is logically const, loading only fills in what has been deferred */
+  const lazy_entry_tables* tables = _tables;
+  ArchiveEntry* self = const_cast<ArchiveEntry*>(this);
+  _tables = nullptr;
+  
+  const box::offset_t nameOffset = binary().entryNameOffset;
+  const box::offset_t payload = binary().payload;
+  const box::count_t payloadLength = binary().payloadLength;
+  
+  if (!tables->names.contains(nameOffset, 1))
+    throw uexc("entry has a name outside of file name table");
+  
+  self->_tableName = tables->names.string(nameOffset - tables->names.offset());
+  
+  if (payloadLength > 0)
+  {
+    self->setPayload(tables->payloads.data(payload, payloadLength), payloadLength);
+    self->unserializePayload(tables->env);
+  }
+}
+
+Archive::Archive() : _sourceCache(std::make_shared<decoded_source_cache>(GB1, false))
 {
   _ordering.push_back(box::Section::HEADER);
   _ordering.push_back(box::Section::SECTION_TABLE);
@@ -29,6 +100,16 @@ Archive::Archive()
   _ordering.push_back(box::Section::STREAM_DATA);
   _ordering.push_back(box::Section::FILE_NAME_TABLE);
   _ordering.push_back(box::Section::GROUP_TABLE);
+  _ordering.push_back(box::Section::NAME_INDEX);
+  _ordering.push_back(box::Section::DIGEST_INDEX);
+  _ordering.push_back(box::Section::SEEK_TABLE);
+}
+
+decoded_source_cache& Archive::sourceCache() const
+{
+  /* options can change at any time so they're applied when cache is requested */
+  _sourceCache->setBudget(_options.sourceCache.budget, _options.sourceCache.spill);
+  return *_sourceCache;
 }
 
 bool Archive::isValidMagicNumber() const { return _header.magic == std::array<u8, 4>({ 'b', 'o', 'x', '!' }); }
@@ -56,12 +137,19 @@ ArchiveSizeInfo Archive::sizeInfo() const
     return count + stream.binary().length;
   });
   
+  const size_t seekPoints = std::accumulate(_streams.begin(), _streams.end(), 0UL, [] (size_t count, const ArchiveStream& stream) {
+    return count + stream.seekPoints().size();
+  });
+  
   const size_t sizeOnDisk = sizeof(box::Header)
   + sizeof(box::Entry) * _entries.size()
   + sizeof(box::Stream) * _streams.size()
   + ((!_entries.empty() && !_streams.empty()) ? sizeof(box::SectionHeader)*4 : 0) /* entry table, stream table, stream data, entry names section headers */
   + (entriesPayload > 0 ? sizeof(box::SectionHeader) : 0)
   + (streamsPayload > 0 ? sizeof(box::SectionHeader) : 0)
+  + (seekPoints > 0 ? sizeof(box::SectionHeader) + sizeof(box::SeekPoint) * seekPoints : 0)
+  + (willSectionBeSerialized(box::Section::NAME_INDEX) ? sizeof(box::SectionHeader) + sizeof(box::NameIndexSlot) * nameIndexSlots(_entries.size()) : 0)
+  + (willSectionBeSerialized(box::Section::DIGEST_INDEX) ? sizeof(box::SectionHeader) + sizeof(box::DigestIndexRecord) * 2 * _entries.size() : 0)
   + std::accumulate(_streams.begin(), _streams.end(), 0UL, [] (size_t count, const ArchiveStream& entry) { return entry.binary().length + count; })
   + std::accumulate(_entries.begin(), _entries.end(), 0UL, [] (size_t count, const ArchiveEntry& entry) { return entry.name().length() + 1 + count; })
   + entriesPayload + streamsPayload;
@@ -98,6 +186,16 @@ bool Archive::checkEntriesMappingToStreams() const
     const box::index_t stream = binary.stream;
     const box::index_t indexInStream = binary.indexInStream;
     
+    /* duplicates are not mapped to streams by themselves, they must refer to an entry which is */
+    if (entry.isDuplicate())
+    {
+      if (binary.original < 0 || binary.original >= _entries.size() || _entries[binary.original].isDuplicate())
+        throw uexc(fmt::sprintf("invalid original entry %d for duplicate entry %lu", binary.original, index));
+      
+      ++index;
+      continue;
+    }
+    
     /* check that stream index and index in stream are set */
     if (indexInStream == box::INVALID_INDEX)
       throw uexc(fmt::sprintf("indexInStream not set for entry %lu", index));
@@ -183,35 +281,52 @@ Archive Archive::ofOneEntryPerStream(const std::vector<std::tuple<std::string, s
 Archive Archive::ofData(const ArchiveFactory::Data& data)
 {
   Archive archive;
+  archive.add(data);
+  archive.options().bufferSize = KB16;
   
+  return archive;
+}
+
+void Archive::add(const ArchiveFactory::Data& data)
+{
   //TODO: check validity (eg multiple ArchiveEntry::ref)b
   
-  archive._entries.reserve(data.entries.size());
+  /* indices read with the archive don't know about new entries */
+  _nameIndex = region_view();
+  _digestIndex = region_view();
+  
+  /* indices in data are relative to its own entries */
+  const box::index_t firstEntry = static_cast<box::index_t>(_entries.size());
+  const box::index_t firstStream = static_cast<box::index_t>(_streams.size());
+  
+  _entries.reserve(_entries.size() + data.entries.size());
   
   for (const auto& entry : data.entries)
-    archive._entries.emplace_back(entry.name, entry.source, entry.filters);
+    _entries.emplace_back(entry.name, entry.source, entry.filters);
   
   for (const auto& stream : data.streams)
-    archive._streams.emplace_back(stream.entries, stream.filters);
+  {
+    std::vector<ArchiveEntry::ref> entries(stream.entries);
+    for (auto& ref : entries)
+      ref += firstEntry;
+    
+    _streams.emplace_back(entries, stream.filters);
+  }
   
-  box::index_t streamIndex = 0, indexInStream = 0;
-  for (const auto& stream : archive._streams)
+  box::index_t streamIndex = firstStream, indexInStream = 0;
+  for (auto it = _streams.begin() + firstStream; it != _streams.end(); ++it)
   {
     indexInStream = 0;
     
-    for (const auto index : stream.entries())
+    for (const auto index : it->entries())
     {
-      archive._entries[index].binary().stream = streamIndex;
-      archive._entries[index].binary().indexInStream = indexInStream;
+      _entries[index].binary().stream = streamIndex;
+      _entries[index].binary().indexInStream = indexInStream;
       ++indexInStream;
     }
     
     ++streamIndex;
   }
-  
-  archive.options().bufferSize = KB16;
-  
-  return archive;
 }
 
 bool Archive::willSectionBeSerialized(box::Section section) const
@@ -231,6 +346,13 @@ bool Archive::willSectionBeSerialized(box::Section section) const
     case box::Section::STREAM_DATA: return !_streams.empty();
       
     case box::Section::GROUP_TABLE: return !_groups.empty();
+    case box::Section::NAME_INDEX: return _options.nameIndex && !_entries.empty();
+    case box::Section::DIGEST_INDEX: return _options.digestIndex && !_entries.empty();
+      
+    /* streams which are encoded get at least one seek point, copied ones keep their own */
+    case box::Section::SEEK_TABLE: return std::any_of(_streams.begin(), _streams.end(), [this] (const ArchiveStream& stream) {
+      return (_options.seekInterval > 0 && !stream.hasOrigin()) || (stream.hasOrigin() && !stream.seekPoints().empty());
+    });
       
     case box::Section::FIRST_FREE_SECTION_IDENT:
       //TODO: custom section serialization management
@@ -238,24 +360,178 @@ bool Archive::willSectionBeSerialized(box::Section section) const
   }
 }
 
-void Archive::write(W& w)
+void Archive::write(W& output)
 {
-  assert(_ordering.front() == box::Section::HEADER);
-  _ordering.pop_front();
-  
-  _headers.clear();
+  /* checksum of everything past the header is computed while data is written */
+  crc32_data_writer w(output, sizeof(box::Header), _options.checksum.calculateGlobalChecksum);
 
-  env = { this, &w, filter_repository::instance() };
+  env = { this, nullptr, filter_repository::instance() };
+  env.w = &w;
 
-  refs refs;
-  refs.header = w.reserve<box::Header>();
+  ref<box::Header> header = w.reserve<box::Header>();
+
+  if (_options.deduplicate)
+    deduplicate(0);
 
   TRACE_A("%p: archive::write() writing %lu entries in %lu streams", this, _entries.size(), _streams.size());
+  
+  writeSections(w, 0);
+  
+  /* this should be the last thing we do since it optionally computes hash for the whole file */
+  finalizeHeader(w.size(), w.get());
+  header.write(_header);
+}
+
+void Archive::append(W& output, const ArchiveFactory::Data& data)
+{
+  if (output.size() != _header.fileLength)
+    throw exceptions::file_format_error("size of archive to append to doesn't match its header");
+  
+  const size_t existingLength = _header.fileLength;
+  const size_t firstStream = _streams.size();
+  
+  /* checksum of existing data is derived from the one stored in the header so that it doesn't need to be read again */
+  box::checksum_t existingChecksum = 0;
+  if (_options.checksum.calculateGlobalChecksum)
+  {
+    if (_header.hasFlag(box::HeaderFlag::INTEGRITY_CHECKSUM_ENABLED))
+      existingChecksum = _header.fileChecksum ^ box::digester_t::shift(headerChecksum(), existingLength - sizeof(box::Header));
+    else
+      existingChecksum = dataChecksum(output, _options.checksum.digesterBuffer);
+  }
+  
+  add(data);
+  
+  if (_options.deduplicate)
+    deduplicate(firstStream);
+  
+  /* everything new goes after existing data, old tables are left unreferenced in the file */
+  output.seek(0, Seek::END);
+  crc32_data_writer w(output, existingLength, _options.checksum.calculateGlobalChecksum);
+  
+  env = { this, nullptr, filter_repository::instance() };
+  env.w = &w;
+  
+  TRACE_A("%p: archive::append() appending %lu streams after %lu bytes", this, _streams.size() - firstStream, existingLength);
+  
+  writeSections(w, firstStream);
+  
+  finalizeHeader(w.size(), box::digester_t::combine(existingChecksum, w.get(), w.size() - existingLength));
+  output.seek(0, Seek::SET);
+  output.write(_header);
+}
 
-  while (!_ordering.empty())
+/* entries whose content matches the one of a previous entry are mapped to its data instead of being stored
+   again, content is compared by size and sha1 and only entries sharing their size with another one are hashed,
+   streams from firstStream which are left without entries are removed */
+void Archive::deduplicate(size_t firstStream)
+{
+  struct content_key
+  {
+    box::length_t size;
+    hash::sha1_t sha1;
+    
+    bool operator==(const content_key& other) const { return size == other.size && sha1 == other.sha1; }
+  };
+  
+  struct content_hash
+  {
+    size_t operator()(const content_key& key) const
+    {
+      size_t hash;
+      std::memcpy(&hash, key.sha1.inner(), sizeof(hash));
+      return hash ^ key.size;
+    }
+  };
+  
+  /* entries read from an archive already have their digest, others can be hashed only if source can be rewound */
+  auto contentSize = [] (ArchiveEntry& entry) -> box::length_t {
+    if (!entry.source())
+      return entry.binary().digest.sha1 == hash::sha1_t() ? 0 : entry.binary().digest.size;
+    
+    seekable_data_source* source = dynamic_cast<seekable_data_source*>(entry.source());
+    return source ? source->size() : 0;
+  };
+  
+  std::unordered_map<box::length_t, size_t> sizes;
+  for (ArchiveEntry& entry : _entries)
+    if (!entry.isDuplicate())
+      ++sizes[contentSize(entry)];
+  
+  std::unique_ptr<byte[]> buffer(new byte[std::max(_options.bufferSize, KB16)]);
+  std::unordered_map<content_key, ArchiveEntry::ref, content_hash> known;
+  bool found = false;
+  
+  for (ArchiveEntry::ref ref = 0; ref < _entries.size(); ++ref)
   {
-    box::Section section = _ordering.front();
-    _ordering.pop_front();
+    ArchiveEntry& entry = _entries[ref];
+    box::length_t size = contentSize(entry);
+    
+    if (entry.isDuplicate() || size == 0 || sizes[size] < 2)
+      continue;
+    
+    content_key key = { size, entry.binary().digest.sha1 };
+    
+    if (entry.source())
+    {
+      seekable_data_source* source = dynamic_cast<seekable_data_source*>(entry.source());
+      hash::sha1_digester digester;
+      size_t read;
+      
+      source->rewind();
+      while ((read = source->read(buffer.get(), std::max(_options.bufferSize, KB16))) != END_OF_STREAM)
+        digester.update(buffer.get(), read);
+      source->rewind();
+      
+      key.sha1 = digester.get();
+    }
+    
+    auto it = known.find(key);
+    
+    if (it == known.end())
+      known.emplace(key, ref);
+    else if (entry.source())
+    {
+      TRACE_A("%p: archive::write() entry %s is a duplicate of %s", this, entry.name().data(), _entries[it->second].name().data());
+
+      entry.binary().original = it->second;
+      _streams[entry.binary().stream].removeEntry(ref);
+      found = true;
+    }
+  }
+  
+  if (!found)
+    return;
+  
+  for (size_t i = _streams.size(); i > firstStream; --i)
+    if (_streams[i - 1].entries().empty())
+      _streams.erase(_streams.begin() + (i - 1));
+  
+  for (size_t i = firstStream; i < _streams.size(); ++i)
+  {
+    box::index_t indexInStream = 0;
+    for (ArchiveEntry::ref ref : _streams[i].entries())
+      _entries[ref].mapToStream(static_cast<box::index_t>(i), indexInStream++);
+  }
+}
+
+/* writes all sections except header, streams before firstStream are considered already written */
+void Archive::writeSections(W& w, size_t firstStream)
+{
+  /* ordering is consumed locally so that the same archive can be written more than once */
+  std::list<box::Section> ordering = _ordering;
+  
+  assert(ordering.front() == box::Section::HEADER);
+  ordering.pop_front();
+  
+  _headers.clear();
+
+  refs refs;
+
+  while (!ordering.empty())
+  {
+    box::Section section = ordering.front();
+    ordering.pop_front();
     
     box::SectionHeader sectionHeader { 0, 0, section, 0 };
 
@@ -265,12 +541,12 @@ void Archive::write(W& w)
         /* already managed */
         
         /* section table must be first section after header */
-        assert(_ordering.front() == box::Section::SECTION_TABLE);
+        assert(ordering.front() == box::Section::SECTION_TABLE);
       break;
         
       case box::Section::SECTION_TABLE:
       {
-        size_t effectiveSections = std::count_if(_ordering.begin(), _ordering.end(), [this] (box::Section section) { return willSectionBeSerialized(section); });
+        size_t effectiveSections = std::count_if(ordering.begin(), ordering.end(), [this] (box::Section section) { return willSectionBeSerialized(section); });
         
         refs.sectionTable = w.reserveArray<box::SectionHeader>(effectiveSections);
 
@@ -318,7 +594,7 @@ void Archive::write(W& w)
            offset inside the file, we also compute the total entry payload 
            length to reserve it
          */
-        for (const ArchiveEntry& entry : _entries)
+        for (ArchiveEntry& entry : _entries)
         {
           box::count_t payloadLength = entry.payloadLength();
           box::Entry& tentry = entry.binary();
@@ -347,7 +623,7 @@ void Archive::write(W& w)
          offset inside the file, we also compute the total entry payload
          length to reserve it
          */
-        for (const ArchiveStream& stream : _streams)
+        for (ArchiveStream& stream : _streams)
         {
           box::count_t payloadLength = stream.payloadLength();
           box::Stream& sentry = stream.binary();
@@ -375,12 +651,12 @@ void Archive::write(W& w)
         sectionHeader.offset = w.tell();
         
         /* write NUL terminated name */
-        for (const ArchiveEntry& entry : _entries)
+        for (ArchiveEntry& entry : _entries)
         {
-          TRACE_A2("%p: archive::write() writing entry name '%s' at %Xh (%lu)", this, entry.name().c_str(), offset, offset);
+          TRACE_A2("%p: archive::write() writing entry name '%s' at %Xh (%lu)", this, entry.name().data(), offset, offset);
           
           entry.binary().entryNameOffset = offset;
-          w.write(entry.name().c_str(), 1, entry.name().length());
+          w.write(entry.name().data(), 1, entry.name().length());
           w.write((char)'\0');
           
           offset = w.tell();
@@ -409,6 +685,7 @@ void Archive::write(W& w)
           w.write((char)'\0');
         }
         
+        offset = w.tell();
         sectionHeader.size = static_cast<box::count_t>(offset - base);
         
         if (sectionHeader.size > 0)
@@ -423,17 +700,106 @@ void Archive::write(W& w)
         break;
       }
         
+      case box::Section::NAME_INDEX:
+      {
+        if (!willSectionBeSerialized(section))
+          break;
+        
+        const size_t slots = nameIndexSlots(_entries.size());
+        const size_t mask = slots - 1;
+        std::vector<box::NameIndexSlot> table(slots, { 0, box::INVALID_INDEX });
+        
+        /* table is at most half full so probing always ends on an empty slot */
+        for (size_t i = 0; i < _entries.size(); ++i)
+        {
+          const std::string_view name = _entries[i].name();
+          const u64 hash = box::nameHash(name.data(), name.length());
+          
+          size_t slot = hash & mask;
+          while (table[slot].entry != box::INVALID_INDEX)
+            slot = (slot + 1) & mask;
+          
+          table[slot] = { hash, static_cast<box::index_t>(i) };
+        }
+        
+        sectionHeader.offset = w.tell();
+        sectionHeader.count = static_cast<box::count_t>(slots);
+        sectionHeader.size = sizeof(box::NameIndexSlot) * slots;
+        w.write(table.data(), sizeof(box::NameIndexSlot), slots);
+        
+        TRACE_A("%p: archive::write() written name index of %lu slots at %Xh (%lu)", this, sectionHeader.count, sectionHeader.offset, sectionHeader.offset);
+        break;
+      }
+        
+      case box::Section::DIGEST_INDEX:
+      {
+        if (!willSectionBeSerialized(section))
+          break;
+        
+        /* streams have been written so digests are known, duplicates take them from their original only later */
+        std::vector<box::DigestIndexRecord> records;
+        records.reserve(_entries.size());
+        
+        for (size_t i = 0; i < _entries.size(); ++i)
+        {
+          const ArchiveEntry& entry = _entries[i];
+          const box::DigestInfo& digest = entry.isDuplicate() ? _entries[entry.binary().original].binary().digest : entry.binary().digest;
+          records.push_back({ digest.crc32, digest.sha1, static_cast<box::index_t>(i) });
+        }
+        
+        sectionHeader.offset = w.tell();
+        sectionHeader.count = static_cast<box::count_t>(records.size());
+        sectionHeader.size = sizeof(box::DigestIndexRecord) * 2 * records.size();
+        
+        std::stable_sort(records.begin(), records.end(), [] (const box::DigestIndexRecord& a, const box::DigestIndexRecord& b) { return a.crc32 < b.crc32; });
+        w.write(records.data(), sizeof(box::DigestIndexRecord), records.size());
+        
+        std::stable_sort(records.begin(), records.end(), [] (const box::DigestIndexRecord& a, const box::DigestIndexRecord& b) {
+          return std::memcmp(a.sha1.inner(), b.sha1.inner(), sizeof(hash::sha1_t)) < 0;
+        });
+        w.write(records.data(), sizeof(box::DigestIndexRecord), records.size());
+        
+        TRACE_A("%p: archive::write() written digest index of %lu entries at %Xh (%lu)", this, sectionHeader.count, sectionHeader.offset, sectionHeader.offset);
+        break;
+      }
+        
+      case box::Section::SEEK_TABLE:
+      {
+        sectionHeader.offset = w.tell();
+        
+        /* points of all streams are stored together, each one tagged with its stream */
+        for (size_t i = 0; i < _streams.size(); ++i)
+        {
+          for (box::SeekPoint point : _streams[i].seekPoints())
+          {
+            point.stream = static_cast<box::index_t>(i);
+            w.write(point);
+            ++sectionHeader.count;
+          }
+        }
+        
+        sectionHeader.size = static_cast<box::length_t>(sizeof(box::SeekPoint) * sectionHeader.count);
+        
+        TRACE_A("%p: archive::write() written seek table of %lu points at %Xh (%lu)", this, sectionHeader.count, sectionHeader.offset, sectionHeader.offset);
+        break;
+      }
+        
       case box::Section::STREAM_DATA:
       {
         sectionHeader.offset = w.tell();
         sectionHeader.count = 1;
         
+        /* when appending the section spans from existing streams to the new ones */
+        for (size_t i = 0; i < firstStream; ++i)
+          sectionHeader.offset = std::min(sectionHeader.offset, _streams[i].binary().offset);
+        
         /* main stream writing */
-        box::index_t streamIndex = 0, indexInStream = 0;
-        for (ArchiveStream& stream : _streams)
+        if (_options.isMultithreaded())
+          writeStreamsConcurrently(w, firstStream);
+        else for (size_t i = firstStream; i < _streams.size(); ++i)
         {
-          indexInStream = 0;
-
+          ArchiveStream& stream = _streams[i];
+          
           stream.binary().offset = w.tell();
           stream.binary().length = 0;
           
@@ -467,6 +833,18 @@ void Archive::write(W& w)
   writeEntryPayloads(w);
   writeStreamPayloads(w);
   
+  /* duplicates share the position and the digest of their original entry */
+  for (ArchiveEntry& entry : _entries)
+  {
+    if (entry.isDuplicate())
+    {
+      const box::Entry& original = _entries[entry.binary().original].binary();
+      entry.mapToStream(original.stream, original.indexInStream);
+      entry.binary().filteredSize = original.filteredSize;
+      entry.binary().digest = original.digest;
+    }
+  }
+  
   /* when we arrive here we suppose all streams have been written and all data
      in Stream and Entry has been prepared and filled */
   
@@ -483,10 +861,176 @@ void Archive::write(W& w)
   /* fill the array of stream entries */
   for (size_t i = 0; i < _streams.size(); ++i)
     refs.streamTable.write(_streams[i].binary(), i);
+}
+
+size_t Archive::nameIndexSlots(size_t entries)
+{
+  size_t slots = 1;
+  while (slots < entries * 2)
+    slots <<= 1;
+  return slots;
+}
+
+const ArchiveEntry* Archive::find(const std::string& name) const
+{
+  if (_nameIndex.length() == 0)
+  {
+    auto it = std::find_if(_entries.begin(), _entries.end(), [&name] (const ArchiveEntry& entry) { return entry.name() == name; });
+    return it != _entries.end() ? &(*it) : nullptr;
+  }
   
-  /* this should be the last thing we do since it optionally computes hash for the whole file */
-  finalizeHeader(w);
-  refs.header.write(_header);
+  const size_t slots = _nameIndex.length() / sizeof(box::NameIndexSlot);
+  const size_t mask = slots - 1;
+  const u64 hash = box::nameHash(name.data(), name.length());
+  
+  for (size_t i = 0, slot = hash & mask; i < slots; ++i, slot = (slot + 1) & mask)
+  {
+    const box::NameIndexSlot current = _nameIndex.at<box::NameIndexSlot>(slot * sizeof(box::NameIndexSlot));
+    
+    if (current.entry == box::INVALID_INDEX)
+      break;
+    else if (current.hash == hash && current.entry >= 0 && current.entry < _entries.size() && _entries[current.entry].name() == name)
+      return &_entries[current.entry];
+  }
+  
+  /* index only knows names stored in the archive, entries renamed since then are scanned */
+  auto it = std::find_if(_entries.begin(), _entries.end(), [&name] (const ArchiveEntry& entry) { return !entry.hasTableName() && entry.name() == name; });
+  return it != _entries.end() ? &(*it) : nullptr;
+}
+
+/* entries whose record in the half of the digest index starting at base is equivalent to key,
+   compare returns negative, zero or positive as strcmp */
+template<typename K, typename C>
+std::vector<ArchiveEntry::ref> Archive::findInDigestIndex(size_t base, const K& key, C compare) const
+{
+  const size_t count = _digestIndex.length() / (2 * sizeof(box::DigestIndexRecord));
+  auto record = [this, base] (size_t i) { return _digestIndex.at<box::DigestIndexRecord>((base + i) * sizeof(box::DigestIndexRecord)); };
+  
+  /* lower bound */
+  size_t first = 0, length = count;
+  while (length > 0)
+  {
+    size_t half = length / 2;
+    
+    if (compare(record(first + half), key) < 0)
+    {
+      first += half + 1;
+      length -= half + 1;
+    }
+    else
+      length = half;
+  }
+  
+  std::vector<ArchiveEntry::ref> refs;
+  for (size_t i = first; i < count; ++i)
+  {
+    const box::DigestIndexRecord current = record(i);
+    
+    if (compare(current, key) != 0)
+      break;
+    else if (current.entry >= 0 && current.entry < _entries.size())
+      refs.push_back(current.entry);
+  }
+  
+  return refs;
+}
+
+std::vector<ArchiveEntry::ref> Archive::findByDigest(hash::crc32_t crc32) const
+{
+  if (_digestIndex.length() == 0)
+  {
+    std::vector<ArchiveEntry::ref> refs;
+    for (ArchiveEntry::ref i = 0; i < _entries.size(); ++i)
+      if (_entries[i].binary().digest.crc32 == crc32)
+        refs.push_back(i);
+    return refs;
+  }
+  
+  return findInDigestIndex(0, crc32, [] (const box::DigestIndexRecord& record, hash::crc32_t crc32) {
+    return record.crc32 < crc32 ? -1 : (record.crc32 > crc32 ? 1 : 0);
+  });
+}
+
+std::vector<ArchiveEntry::ref> Archive::findByDigest(const hash::sha1_t& sha1) const
+{
+  if (_digestIndex.length() == 0)
+  {
+    std::vector<ArchiveEntry::ref> refs;
+    for (ArchiveEntry::ref i = 0; i < _entries.size(); ++i)
+      if (_entries[i].binary().digest.sha1 == sha1)
+        refs.push_back(i);
+    return refs;
+  }
+  
+  const size_t base = _digestIndex.length() / (2 * sizeof(box::DigestIndexRecord));
+  return findInDigestIndex(base, sha1, [] (const box::DigestIndexRecord& record, const hash::sha1_t& sha1) {
+    return std::memcmp(record.sha1.inner(), sha1.inner(), sizeof(hash::sha1_t));
+  });
+}
+
+const ArchiveEntry* Archive::findByDigest(const box::DigestInfo& digest) const
+{
+  /* candidates are narrowed by sha1, the rest of the digest is compared on the records */
+  for (ArchiveEntry::ref ref : findByDigest(digest.sha1))
+  {
+    const ArchiveEntry& entry = _entries[ref];
+    const box::DigestInfo& candidate = entry.isDuplicate() ? _entries[entry.binary().original].binary().digest : entry.binary().digest;
+    
+    if (candidate == digest)
+      return &entry;
+  }
+  
+  return nullptr;
+}
+
+const ArchiveEntry* Archive::findSource(const box::DigestInfo& digest) const
+{
+  std::vector<box::DigestInfo> chain;
+  return findSource(digest, chain);
+}
+
+const ArchiveEntry* Archive::findSource(const box::DigestInfo& digest, std::vector<box::DigestInfo>& chain) const
+{
+  /* a digest which is already being resolved would make sources depend on themselves */
+  if (std::find(chain.begin(), chain.end(), digest) != chain.end())
+    return nullptr;
+  
+  std::vector<const ArchiveEntry*> candidates;
+  for (ArchiveEntry::ref ref : findByDigest(digest.sha1))
+  {
+    const ArchiveEntry& entry = _entries[ref];
+    const ArchiveEntry& original = entry.isDuplicate() ? _entries[entry.binary().original] : entry;
+    
+    if (original.binary().digest == digest)
+      candidates.push_back(&original);
+  }
+  
+  auto it = std::find_if(candidates.begin(), candidates.end(), [] (const ArchiveEntry* entry) { return !entry->filters().sourceDigest(); });
+  
+  if (it != candidates.end())
+    return *it;
+  
+  chain.push_back(digest);
+  
+  const ArchiveEntry* result = nullptr;
+  for (const ArchiveEntry* candidate : candidates)
+  {
+    if (findSource(*candidate->filters().sourceDigest(), chain))
+    {
+      result = candidate;
+      break;
+    }
+  }
+  
+  chain.pop_back();
+  
+  return result;
+}
+
+region_view Archive::sectionRegion(R& r, box::Section section) const
+{
+  auto it = _headers.find(section);
+  return it != _headers.end() ? region_view(r, it->second.offset, it->second.size) : region_view();
 }
 
 void Archive::readSection(R& r, const box::SectionHeader& header)
@@ -501,85 +1045,92 @@ void Archive::readSection(R& r, const box::SectionHeader& header)
     
     case S::ENTRY_TABLE:
     {
-      /* read entries */
-      for (size_t i = 0; i < header.count; ++i)
+      /* records, names and payloads are each read as a whole table and decoded from memory */
+      if (_headers.find(S::FILE_NAME_TABLE) == _headers.end())
+        throw uexc("entry table without a file name table");
+      
+      /* records of version 1 have no original field, they're widened once into a table of current records */
+      const size_t stride = _header.version == box::FIRST_VERSION ? offsetof(box::Entry, original) : sizeof(box::Entry);
+      
+      region_view table(r, header.offset, header.count * stride);
+      
+      if (stride != sizeof(box::Entry))
       {
-        r.seek(header.offset + i*sizeof(box::Entry));
-        
-        /* read entry */
-        box::Entry entry;
-        r.read(entry);
-        
-        /* read entry name */
-        r.seek(entry.entryNameOffset);
-        //TODO: ugly
-        std::string name;
-        char c;
-        r.read(c);
-        while (c) {
-          name += c;
-          r.read(c);
-        }
+        byte* widened = new byte[header.count * sizeof(box::Entry)];
+        std::shared_ptr<const byte> data(widened, std::default_delete<byte[]>());
         
-        /* load payload */
-        std::vector<byte> payload;
-        if (entry.payloadLength > 0)
+        for (size_t i = 0; i < header.count; ++i)
         {
-          payload.resize(entry.payloadLength);
-          r.seek(entry.payload);
-          r.read(payload.data(), entry.payloadLength);
+          box::Entry entry;
+          std::memcpy(&entry, table.data() + i*stride, stride);
+          std::memcpy(widened + i*sizeof(box::Entry), &entry, sizeof(box::Entry));
         }
         
-        _entries.emplace_back(name, entry, payload);
+        table = region_view(data, header.offset, header.count * sizeof(box::Entry));
       }
-
+      
+      /* entries are built from their record only, names and payloads tables are kept to load them later */
+      _lazyTables = std::make_shared<lazy_entry_tables>(_options, filter_repository::instance());
+      _lazyTables->names = sectionRegion(r, S::FILE_NAME_TABLE);
+      _lazyTables->payloads = sectionRegion(r, S::ENTRY_PAYLOAD);
+      
+      _entries.reserve(header.count);
+      
+      for (size_t i = 0; i < header.count; ++i)
+        _entries.emplace_back(reinterpret_cast<const box::Entry*>(table.data() + i*sizeof(box::Entry)), _lazyTables.get());
+      
+      _tables.push_back(table);
+      
       break;
     }
       
     case S::STREAM_TABLE:
     {
+      const region_view table(r, header.offset, header.count * sizeof(box::Stream));
+      
+      const region_view payloads = sectionRegion(r, S::STREAM_PAYLOAD);
+      
+      _streams.reserve(header.count);
+      
       for (size_t i = 0; i < header.count; ++i)
       {
-        r.seek(header.offset + i*sizeof(box::Stream));
-        
-        /* read stream header */
-        box::Stream stream;
-        r.read(stream);
+        const box::Stream* stream = reinterpret_cast<const box::Stream*>(table.data() + i*sizeof(box::Stream));
+        const box::offset_t payload = stream->payload;
+        const box::count_t payloadLength = stream->payloadLength;
         
-        /* load payload */
-        std::vector<byte> payload;
-        if (stream.payloadLength > 0)
-        {
-          payload.resize(stream.payloadLength);
-          r.seek(stream.payload);
-          r.read(payload.data(), stream.payloadLength);
-        }
-        
-        _streams.emplace_back(stream, payload);
+        _streams.emplace_back(stream, payloadLength > 0 ? payloads.data(payload, payloadLength) : nullptr);
+        _streams.back().setOrigin(&r);
       }
       
+      _tables.push_back(table);
+      
       break;
     }
       
     case S::GROUP_TABLE:
     {
-      r.seek(header.offset);
+      /* archives written before group table size was stored have it set to 0, then it extends until the end */
+      const size_t length = header.size > 0 ? header.size : r.size() - header.offset;
+      const region_view table(r, header.offset, length);
+      
+      size_t offset = 0;
       for (size_t i = 0; i < header.count; ++i)
       {
-        box::count_t size;
-        r.read(size);
+        if (offset + sizeof(box::count_t) > length)
+          throw uexc(fmt::sprintf("group %lu is outside of group table", i));
+        
+        box::count_t size = table.at<box::count_t>(offset);
+        offset += sizeof(box::count_t);
+        
+        if (offset + sizeof(ArchiveEntry::ref) * size > length)
+          throw uexc(fmt::sprintf("group %lu is outside of group table", i));
         
         std::vector<ArchiveEntry::ref> indices(size);
-        r.read((byte*)indices.data(), sizeof(ArchiveEntry::ref) * size);
-        
-        //TODO: ugly
-        std::string name;
-        char c;
-        r.read(c);
-        while (c) {
-          name += c;
-          r.read(c);
-        }
+        std::memcpy(indices.data(), table.data() + offset, sizeof(ArchiveEntry::ref) * size);
+        offset += sizeof(ArchiveEntry::ref) * size;
+        
+        std::string name(table.string(offset));
+        offset += name.length() + 1;
         
         _groups.emplace_back(name, indices);
       }
@@ -599,6 +1150,42 @@ void Archive::readSection(R& r, const box::SectionHeader& header)
     case S::FILE_NAME_TABLE:
       /* do nothing, these are managed when reading respective parents */
       break;
+      
+    case S::SEEK_TABLE:
+      /* do nothing, this is read after streams since sections are not read in order */
+      break;
+      
+    case S::NAME_INDEX:
+    {
+      if (header.count == 0 || (header.count & (header.count - 1)) != 0 || header.size != header.count * sizeof(box::NameIndexSlot))
+        throw uexc(fmt::sprintf("name index of %lu slots is not valid", header.count));
+      
+      _nameIndex = region_view(r, header.offset, header.size);
+      break;
+    }
+      
+    case S::DIGEST_INDEX:
+    {
+      if (header.size != header.count * 2 * sizeof(box::DigestIndexRecord))
+        throw uexc(fmt::sprintf("digest index of %lu entries is not valid", header.count));
+      
+      _digestIndex = region_view(r, header.offset, header.size);
+      break;
+    }
+  }
+}
+
+void Archive::readSeekTable(R& r, const box::SectionHeader& header)
+{
+  const region_view table(r, header.offset, header.count * sizeof(box::SeekPoint));
+  for (size_t i = 0; i < header.count; ++i)
+  {
+    box::SeekPoint point = table.at<box::SeekPoint>(i * sizeof(box::SeekPoint));
+    
+    if (point.stream >= _streams.size())
+      throw uexc(fmt::sprintf("seek point %lu refers to invalid stream %d", i, point.stream));
+    
+    _streams[point.stream].addSeekPoint(point);
   }
 }
 
@@ -609,6 +1196,11 @@ void Archive::read(R& r)
   _entries.clear();
   _streams.clear();
   _groups.clear();
+  _tables.clear();
+  _lazyTables.reset();
+  _sourceCache->clear();
+  _nameIndex = region_view();
+  _digestIndex = region_view();
   
   env = { this, &r, filter_repository::instance() };
   
@@ -616,26 +1208,35 @@ void Archive::read(R& r)
   r.seek(0);
   r.read(_header);
   
+  if (!isValidMagicNumber())
+    throw uexc("invalid magic number, expecting 'box!'");
+  
+  const box::version_t version = _header.version;
+  if (version < box::FIRST_VERSION || version > box::CURRENT_VERSION)
+    throw uexc(fmt::sprintf("unsupported archive version %u, expecting at most %u", version, box::CURRENT_VERSION));
+  
   /* read sections */
-  r.seek(_header.index.offset);
+  const region_view sectionTable(r, _header.index.offset, _header.index.count * sizeof(box::SectionHeader));
   for (size_t i = 0; i < _header.index.count; ++i)
   {
-    box::SectionHeader header;
-    r.read(header);
+    box::SectionHeader header = sectionTable.at<box::SectionHeader>(i * sizeof(box::SectionHeader));
     _headers.emplace(std::make_pair(header.type, header));
   }
   
-  if (!isValidMagicNumber())
-    throw uexc("invalid magic number, expecting 'box!'");
   //TODO: check validity checksum etc
   
   /* read each section if needed */
   for (const auto& section : _headers)
     readSection(r, section.second);
   
-  /* unserialize payload for filters */
-  for (auto& entry : _entries)
-    entry.unserializePayload(env);
+  auto seekTable = _headers.find(box::Section::SEEK_TABLE);
+  if (seekTable != _headers.end())
+    readSeekTable(r, seekTable->second);
+  
+  /* load names and filters of entries unless they're loaded when first accessed */
+  if (!_options.lazyEntries)
+    for (const auto& entry : _entries)
+      entry.name();
   for (auto& stream : _streams)
     stream.unserializePayload(env);
 
@@ -646,7 +1247,7 @@ void Archive::read(R& r)
     box::index_t stream = entry.binary().stream;
     box::index_t indexInStream = entry.binary().indexInStream;
     
-    if (stream != box::INVALID_INDEX && indexInStream != box::INVALID_INDEX && stream < _streams.size())
+    if (!entry.isDuplicate() && stream != box::INVALID_INDEX && indexInStream != box::INVALID_INDEX && stream < _streams.size())
       _streams[stream].assignEntryAtIndex(indexInStream, index);
     
     ++index;
@@ -656,10 +1257,9 @@ void Archive::read(R& r)
   checkEntriesMappingToStreams();
 }
 
-void Archive::finalizeHeader(W& w)
+void Archive::finalizeHeader(size_t fileLength, box::checksum_t dataChecksum)
 {
-  w.seek(0, Seek::END);
-  _header.fileLength = w.tell();
+  _header.fileLength = fileLength;
   
   _header.version = box::CURRENT_VERSION;
   
@@ -668,33 +1268,177 @@ void Archive::finalizeHeader(W& w)
   if (_options.checksum.calculateGlobalChecksum)
   {
     _header.flags.set(box::HeaderFlag::INTEGRITY_CHECKSUM_ENABLED);
-    _header.fileChecksum = calculateGlobalChecksum(w, _options.checksum.digesterBuffer);
+    _header.fileChecksum = globalChecksum(dataChecksum, _header.fileLength - sizeof(box::Header));
   }
 }
 
-box::checksum_t Archive::calculateGlobalChecksum(W& w, size_t bufferSize) const
+box::checksum_t Archive::headerChecksum() const
 {
   /* we need to calculate checksum of file but we need to skip the checksum itself */
   offset_t checksumOffset = offsetof(box::Header, fileChecksum);
+  const byte* header = reinterpret_cast<const byte*>(&_header);
 
   box::digester_t digester;
-  w.seek(0);
-  byte* buffer = new byte[bufferSize];
+  digester.update(header, checksumOffset);
+  digester.update(header + checksumOffset + sizeof(box::checksum_t), sizeof(box::Header) - checksumOffset - sizeof(box::checksum_t));
+  
+  return digester.get();
+}
+
+box::checksum_t Archive::globalChecksum(box::checksum_t dataChecksum, size_t dataLength) const
+{
+  return box::digester_t::combine(headerChecksum(), dataChecksum, dataLength);
+}
+
+box::checksum_t Archive::dataChecksum(W& w, size_t bufferSize) const
+{
+  box::digester_t digester;
+  std::unique_ptr<byte[]> buffer(new byte[bufferSize]);
   
-  digester.update(&_header, checksumOffset);
-  digester.update(&_header + sizeof(box::checksum_t), sizeof(box::Header) - checksumOffset - sizeof(box::checksum_t));
   w.seek(sizeof(box::Header), Seek::SET);
   
   size_t read = 0;
-  while ((read = w.read(buffer, 1, bufferSize)) > 0)
-    digester.update(buffer, read);
-  
-  delete [] buffer;
+  while ((read = w.read(buffer.get(), 1, bufferSize)) > 0)
+    digester.update(buffer.get(), read);
   
   return digester.get();
 }
 
-void Archive::writeStream(W& w, ArchiveStream& stream)
+box::checksum_t Archive::calculateGlobalChecksum(W& w, size_t bufferSize) const
+{
+  return globalChecksum(dataChecksum(w, bufferSize), w.size() - sizeof(box::Header));
+}
+
+void Archive::writeStreamsConcurrently(W& w, size_t firstStream)
+{
+  /* copied streams share the reader of the archive they come from so they're done serially */
+  auto isIndependent = [this] (const ArchiveStream& stream) {
+    return !stream.hasOrigin() && !hasExternalDependencies(stream);
+  };
+  
+  /* budget must outlive buffers since they give their memory back to it */
+  memory_budget budget(_options.memoryBudget);
+  const size_t chunkSize = std::max(KB16, std::min(MB1, _options.memoryBudget / std::max(_options.threads, size_t(1))));
+  
+  std::vector<std::unique_ptr<spill_buffer>> buffers(_streams.size());
+  std::vector<std::future<void>> tasks(_streams.size());
+  
+  /* declared last so that workers are joined before buffers are released */
+  concurrency::thread_pool pool(_options.threads);
+  
+  TRACE_A("%p: archive::write() encoding streams on %lu threads", this, pool.size());
+  
+  /* independent streams are encoded concurrently each into its own buffer */
+  for (size_t i = firstStream; i < _streams.size(); ++i)
+  {
+    ArchiveStream& stream = _streams[i];
+
+    if (isIndependent(stream))
+    {
+      spill_buffer* buffer = new spill_buffer(budget, chunkSize);
+      buffers[i].reset(buffer);
+      tasks[i] = pool.submit([this, &stream, buffer] () { writeStream(*buffer, stream); });
+    }
+  }
+  
+  /* then everything is concatenated in index order so offsets are the same of the serial path */
+  for (size_t i = firstStream; i < _streams.size(); ++i)
+  {
+    ArchiveStream& stream = _streams[i];
+    
+    if (tasks[i].valid())
+      tasks[i].get();
+    else
+    {
+      /* dependent streams can read sources of other streams so they wait for all encoders to finish */
+      for (const auto& task : tasks)
+        if (task.valid())
+          task.wait();
+    }
+    
+    stream.binary().offset = w.tell();
+    
+    TRACE_A("%p: archive::write() writing stream at offset %Xh (%lu)", this, stream.binary().offset, stream.binary().offset);
+
+    if (buffers[i])
+    {
+      buffers[i]->writeTo(w, std::max(_options.bufferSize, KB16));
+      buffers[i].reset();
+    }
+    else
+      writeStream(w, stream);
+  }
+}
+
+bool Archive::hasExternalDependencies(const ArchiveStream& stream) const
+{
+  return stream.filters().hasExternalDependencies() || std::any_of(stream.entries().begin(), stream.entries().end(), [this] (ArchiveEntry::ref ref) {
+    return entryForRef(ref).filters().hasExternalDependencies();
+  });
+}
+
+void Archive::extract(R& r, const entry_sink_factory& sinks, const reader_factory& readers)
+{
+  /* duplicates are not part of any stream, they're written together with their original */
+  duplicates_map duplicates;
+  for (ArchiveEntry::ref i = 0; i < _entries.size(); ++i)
+    if (_entries[i].isDuplicate())
+      duplicates[_entries[i].binary().original].push_back(i);
+  
+  std::vector<const ArchiveStream*> serial;
+  
+  if (_options.isMultithreaded() && readers)
+  {
+    std::vector<std::future<void>> tasks;
+    
+    /* declared last so that workers are joined before anything they use is released */
+    concurrency::thread_pool pool(_options.threads);
+    
+    TRACE_A("%p: archive::extract() extracting streams on %lu threads", this, pool.size());
+    
+    for (const ArchiveStream& stream : _streams)
+    {
+      /* streams which read other entries while decoded share the main reader so they're done serially */
+      if (hasExternalDependencies(stream))
+        serial.push_back(&stream);
+      else
+        tasks.push_back(pool.submit([this, &stream, &sinks, &readers, &duplicates] () {
+          std::unique_ptr<R> reader = readers();
+          extractStream(*reader, stream, sinks, duplicates);
+        }));
+    }
+    
+    for (auto& task : tasks)
+      task.get();
+  }
+  else
+    std::transform(_streams.begin(), _streams.end(), std::back_inserter(serial), [] (const ArchiveStream& stream) { return &stream; });
+  
+  for (const ArchiveStream* stream : serial)
+    extractStream(r, *stream, sinks, duplicates);
+}
+
+void Archive::extractStream(R& r, const ArchiveStream& stream, const entry_sink_factory& sinks, const duplicates_map& duplicates) const
+{
+  ArchiveStreamReader reader(r, *this, stream);
+  
+  reader.extract([this, &sinks, &duplicates] (const ArchiveEntry& entry) {
+    auto it = duplicates.find(static_cast<ArchiveEntry::ref>(&entry - _entries.data()));
+    
+    if (it == duplicates.end())
+      return sinks(entry);
+    
+    /* entry and its duplicates are written together */
+    std::vector<std::unique_ptr<data_sink>> targets;
+    targets.push_back(sinks(entry));
+    for (ArchiveEntry::ref duplicate : it->second)
+      targets.push_back(sinks(_entries[duplicate]));
+    
+    return std::unique_ptr<data_sink>(new broadcast_data_sink(std::move(targets)));
+  });
+}
+
+void Archive::writeStream(data_sink& w, ArchiveStream& stream)
 {
   using digester_t = unbuffered_source_filter<filters::multiple_digest_filter>;
   using counter_t = unbuffered_source_filter<filters::data_counter>;
@@ -709,6 +1453,15 @@ void Archive::writeStream(W& w, ArchiveStream& stream)
     filter_cache cache;
   };
   
+  /* streams loaded from an archive which haven't been modified don't need to be filtered again,
+     sizes and digests of their entries are already known */
+  if (stream.hasOrigin())
+  {
+    copyStream(w, stream);
+    stream.binary().length = stream.originLength();
+    return;
+  }
+  
   std::vector<data_source_helper> sources;
   
   sources.reserve(stream.entries().size());
@@ -718,29 +1471,38 @@ void Archive::writeStream(W& w, ArchiveStream& stream)
     ArchiveEntry& entry = _entries[index];
     data_source* source = entry.source();
 
-    /* if source is nullptr we need to prepare it from the existing archive */
+    /* entries loaded from an archive can only be written together with their unmodified stream */
     if (!source)
-    {
-
-    }
+      throw exceptions::missing_source_file_exception("entry '" + std::string(entry.name()) + "' has no source and its stream has been modified");
+    
+    /* when pipelined reading from source happens on its own thread */
+    threaded_data_source* reader = _options.pipelined ? new threaded_data_source(source, _options.bufferSize) : nullptr;
     
     /* first we wrap with a counter filter to calculate the original input size */
-    auto* inputCounter = new counter_t(source);
+    auto* inputCounter = new counter_t(reader ? reader : source);
     /* then we apply digest calculator filter */
-    auto* digester = new digester_t(inputCounter, _options.digest.crc32, _options.digest.md5, _options.digest.sha1);
+    auto* digester = new digester_t(inputCounter, _options.digest.crc32, _options.digest.md5, _options.digest.sha1, _options.digest.parallel);
+    
+    /* and hashing too, so that it overlaps with filters */
+    threaded_data_source* hasher = _options.pipelined ? new threaded_data_source(digester, _options.bufferSize) : nullptr;
     
     /* then we apply all filters from entry */
     entry.filters().setup(env);
-    filter_cache cache = entry.filters().apply(digester);
+    filter_cache cache = entry.filters().apply(hasher ? static_cast<data_source*>(hasher) : digester);
 
     /* size of input transformed by entry filters before being sent to stream */
     auto* filteredCounter = new counter_t(cache.get());
     
     source = filteredCounter;
 
-    /* add counters to cache to allow releasing them after we've done with the stream */
+    /* add counters to cache to allow releasing them after we've done with the stream,
+       cache releases in reverse order so stages are stopped before what they read from */
+    if (reader)
+      cache.cache(reader);
     cache.cache(inputCounter);
     cache.cache(digester);
+    if (hasher)
+      cache.cache(hasher);
     cache.cache(filteredCounter);
   
     /* we move because cache contains unique_ptr */
@@ -753,41 +1515,85 @@ void Archive::writeStream(W& w, ArchiveStream& stream)
   std::transform(sources.begin(), sources.end(), std::back_inserter(sourcesOnly), [] (const data_source_helper& helper) { return helper.source; });
   multiple_data_source source(sourcesOnly);
   
-  /* then we apply all filters from stream */
-  stream.filters().setup(env);
-  filter_cache streamCache = stream.filters().apply(&source);
-  
-  counter_t wholeCounter(streamCache.get());
-
-  data_source* finalStream = &wholeCounter;
+  /* with seek points stream filters are restarted at the first entry boundary past the interval,
+     each segment is then decodable on its own starting from its point */
+  const bool segmented = _options.seekInterval > 0;
+  box::length_t filtered = 0, segmentStart = 0;
+  box::index_t nextEntry = 0;
 
 #if defined(DEBUG)
   source.setOnBegin([this, &sources](data_source* source) {
     auto it = std::find_if(sources.begin(), sources.end(), [source](const data_source_helper& helper) { return helper.source == source; });
     assert(it != sources.end());
     auto& entry = it->entry;
-    TRACE_A("%p: archive::write() preparing to write entry %s", this, entry.name().c_str());
+    TRACE_A("%p: archive::write() preparing to write entry %s", this, entry.name().data());
   });
 #endif
 
-  source.setOnEnd([this, &sources](data_source* source) {
+  /* when pipelined this is called from filtering thread, which is joined before state is used again */
+  source.setOnEnd([this, &sources, &source, &filtered, &segmentStart, &nextEntry, segmented](data_source* current) {
     /* TODO: this is linear, we can use a std::unordered_map if really many entries are stored in single stream but it's quite irrelevant */
-    auto it = std::find_if(sources.begin(), sources.end(), [source](const data_source_helper& helper) { return helper.source == source; });
+    auto it = std::find_if(sources.begin(), sources.end(), [current](const data_source_helper& helper) { return helper.source == current; });
     assert(it != sources.end());
     TRACE_A("%p: archive::write() written %lu bytes, filtered into %lu", this, it->inputCounter->filter().count(), it->filteredCounter->filter().count());
-  });
     
-  assert(_options.bufferSize > 0);
-  passthrough_pipe pipe(finalStream, &w, _options.bufferSize);
-  pipe.process([this, &wholeCounter, &sources]() {
-    //TODO: performance costly
-    size_t inputSum = 0;
-    for (const data_source_helper& helper : sources)
-      inputSum += helper.inputCounter->filter().count();
- 
-    TRACE_A("%p: archive::write() processed %s into %s bytes", this, strings::humanReadableSize(inputSum, true).c_str(), strings::humanReadableSize(wholeCounter.filter().count(), true).c_str());
+    filtered += it->filteredCounter->filter().count();
+    nextEntry = static_cast<box::index_t>(std::distance(sources.begin(), it) + 1);
+    
+    if (segmented && filtered - segmentStart >= _options.seekInterval)
+      source.pause();
   });
   
+  stream.clearSeekPoints();
+  stream.binary().flags.set(box::StreamFlag::SEEKABLE, segmented);
+  stream.binary().length = 0;
+  
+  assert(_options.bufferSize > 0);
+  
+  do
+  {
+    source.resume();
+    segmentStart = filtered;
+    
+    if (segmented)
+      stream.addSeekPoint({ box::INVALID_INDEX, nextEntry, stream.binary().length, filtered });
+    
+    /* then we apply all filters from stream */
+    stream.filters().setup(env);
+    filter_cache streamCache = stream.filters().apply(&source);
+    
+    counter_t wholeCounter(streamCache.get());
+
+    data_source* finalStream = &wholeCounter;
+    
+    /* last stage runs all the filters while calling thread is left writing to the sink */
+    std::unique_ptr<threaded_data_source> filterer;
+    if (_options.pipelined)
+    {
+      filterer.reset(new threaded_data_source(&wholeCounter, _options.bufferSize));
+      finalStream = filterer.get();
+    }
+    
+    passthrough_pipe pipe(finalStream, &w, _options.bufferSize);
+    
+    /* counters are owned by other threads while pipelined so they can't be monitored */
+    if (_options.pipelined)
+      pipe.process();
+    else pipe.process([this, &wholeCounter, &sources]() {
+      //TODO: performance costly
+      size_t inputSum = 0;
+      for (const data_source_helper& helper : sources)
+        inputSum += helper.inputCounter->filter().count();
+   
+      TRACE_A("%p: archive::write() processed %s into %s bytes", this, strings::humanReadableSize(inputSum, true).c_str(), strings::humanReadableSize(wholeCounter.filter().count(), true).c_str());
+    });
+    
+    /* filterer must be stopped before the counter it reads from is released */
+    filterer.reset();
+    
+    stream.binary().length += wholeCounter.filter().count();
+  } while (!source.ended());
+  
   for (const data_source_helper& helper : sources)
   {
     auto& entry = helper.entry;
@@ -804,8 +1610,28 @@ void Archive::writeStream(W& w, ArchiveStream& stream)
     if (_options.digest.sha1)
       entry.binary().digest.sha1 = helper.digester->filter().sha1();
   }
+}
+
+void Archive::copyStream(data_sink& w, const ArchiveStream& stream)
+{
+  R& r = *stream.origin();
+  size_t remaining = stream.originLength();
+  
+  TRACE_A("%p: archive::write() copying %lu bytes of unmodified stream from %Xh (%lu)", this, remaining, stream.originOffset(), stream.originOffset());
+
+  std::unique_ptr<byte[]> buffer(new byte[_options.bufferSize]);
+  r.seek(stream.originOffset());
   
-  stream.binary().length = wholeCounter.filter().count();
+  while (remaining > 0)
+  {
+    size_t read = r.read(buffer.get(), std::min(remaining, _options.bufferSize));
+    
+    if (read == END_OF_STREAM || read == 0)
+      throw uexc("unexpected end of data while copying stream from source archive");
+    
+    w.write(buffer.get(), read);
+    remaining -= read;
+  }
 }
 
 /* precondition: payload offset has been set for entries */
@@ -816,7 +1642,7 @@ void Archive::writeEntryPayloads(W& w)
     entry.serializePayload(env);
     const memory_buffer& payload = entry.payload();
     
-    w.seek(entry.binary().payload);
+    w.seek(entry.binary().payload, Seek::SET);
     w.write(payload.raw(), 1, payload.size());
   }
 }
@@ -829,88 +1655,231 @@ void Archive::writeStreamPayloads(W& w)
     stream.serializePayload(env);
     const memory_buffer& payload = stream.payload();
     
-    w.seek(stream.binary().payload);
+    w.seek(stream.binary().payload, Seek::SET);
     w.write(payload.raw(), 1, payload.size());
   }
 }
 
+ArchiveReadHandle::ArchiveReadHandle(R& r, const Archive& archive, const ArchiveEntry& entry) : r(r), _archive(archive),
+  _entry(entry.isDuplicate() ? archive.entries()[entry.binary().original] : entry), _source(nullptr) { }
+
 data_source* ArchiveReadHandle::source(bool total)
 {
   _cache.clear();
   
   TRACE_A("%p: archive::read() reading entry from stream %lu:%lu (size: %lu %lu)", this, _entry.binary().stream, _entry.binary().indexInStream, _entry.binary().digest.size, _entry.binary().filteredSize);
 
-  /* first we need to know if stream is seekable, if it is we can seek to correct entry
-     offset before reading from it, otherwise we need to skip */
+  /* first we need to know if stream is seekable, if it is we can start decoding from the nearest
+     seek point preceding the entry, otherwise we need to start from the beginning of the stream */
   const ArchiveStream& stream = _archive.streams()[_entry.binary().stream];
-  
-  bool isSeekable = stream.binary().flags && box::StreamFlag::SEEKABLE;
+  const box::index_t indexInStream = _entry.binary().indexInStream;
   
   data_source* source = &r;
   
   size_t offset = stream.binary().offset;
+  size_t length = stream.binary().length;
+  size_t skipAmount = 0;
+  size_t amount = _entry.binary().filteredSize;
   
-  /* TODO: need to fix const-cast */
-  _env = { const_cast<Archive*>(&_archive), &r, filter_repository::instance() };
+  for (box::index_t i = 0; i < indexInStream; ++i)
+    skipAmount += _archive.entries()[stream.entries()[i]].binary().filteredSize;
   
-  /*if (isSeekable)
+  if (stream.isSeekable())
   {
-    // if stream is seekable we can find the offset to start reading from by adding all previous
-    //   entries in the stream
-    for (box::index_t i = 0; i < _entry.binary().indexInStream; ++i)
-      offset += _archive.entries()[stream.entries()[i]].binary().compressedSize;
+    /* points are sorted by entry so last one not past the entry is the nearest */
+    auto it = std::upper_bound(stream.seekPoints().begin(), stream.seekPoints().end(), indexInStream, [] (box::index_t index, const box::SeekPoint& point) {
+      return index < point.indexInStream;
+    });
     
-    source_filter<filters::skip_filter>* skipper = new source_filter<filters::skip_filter>(source, _archive.options().bufferSize, 0, _entry.binary().compressedSize, 0);
-    _cache.cache(skipper);
-    source = skipper;
-  }*/
+    assert(it != stream.seekPoints().begin());
+    const box::SeekPoint& point = *std::prev(it);
+    
+    /* segment ends where next one starts */
+    length = (it != stream.seekPoints().end() ? it->offset : length) - point.offset;
+    offset += point.offset;
+    skipAmount -= point.filteredOffset;
+  }
   
-  /* move to the start of the stream */
-  /*TODO: lambda_init_data_source is leaking */
-  source = new lambda_init_data_source<data_source>(source, [this, offset]()
-  {
-    r.seek(offset);
-  });
+  /* TODO: need to fix const-cast */
+  _env = { const_cast<Archive*>(&_archive), &r, filter_repository::instance() };
   
-  //source = new source_filter<filters::skip_filter>(source, _archive.options().bufferSize, 0, _entry.binary().filteredSize, 0);
+  /* stream data is read through a slice which starts at the beginning of the stream */
+  seekable_source_slice* slice = new seekable_source_slice(&r, offset, length);
+  source = slice;
   
-  /* this doesn't unapply entry filters, just stream filters */
+  /* this doesn't unapply entry filters, just stream filters, block compressed streams start decoding from the block of the entry */
   _cache.setSource(source);
+  _cache.cache(slice);
   stream.filters().unsetup(_env);
-  stream.filters().unapply(_cache);
-  
-  if (total)
-  {
-    _entry.filters().unsetup(_env);
-    _entry.filters().unapply(_cache);
-  }
+  stream.filters().unapply(_cache, skipAmount);
 
   source = _cache.get();
   
-  /* if stream is not seekable then we need to skip up to uncompressed size of all previous entries */
-  if (!isSeekable)
+  /* then we need to skip up to filtered size of all previous entries from the starting point,
+     skipping must happen before entry filters are unapplied since they start from entry boundary */
   {
-    size_t skipAmount = 0;
-    size_t amount = total ? _entry.binary().digest.size : _entry.binary().filteredSize;
-    
-    for (box::index_t i = 0; i < _entry.binary().indexInStream; ++i)
-    {
-      const auto& b = _archive.entries()[stream.entries()[i]].binary();
-      /* the amount to skip depends if we're extracting from stream filters or from both stream and entry */
-      skipAmount += total ? b.digest.size : b.filteredSize;
-    }
-    
-    TRACE_A("%p: archive::read() stream not seekable, preparing to seek to %lu+%lu and produce %lu bytes", this, offset, skipAmount, amount);
-
+    TRACE_A("%p: archive::read() preparing to seek to %lu+%lu and produce %lu bytes", this, offset, skipAmount, amount);
 
     source_filter<filters::skip_filter>* skipper = new source_filter<filters::skip_filter>(source, _archive.options().bufferSize, skipAmount, amount, 0);
     _cache.cache(skipper);
+    _cache.setSource(skipper);
     source = skipper;
   }
+  
+  if (total)
+  {
+    _entry.filters().unsetup(_env);
+    _entry.filters().unapply(_cache);
+    source = _cache.get();
+  }
 
+  _source = source;
   return source;
 }
 
 
 
 
+
+ArchiveStreamReader::ArchiveStreamReader(R& r, const Archive& archive, const ArchiveStream& stream) : r(r), _archive(archive), _stream(stream),
+  _segment(box::INVALID_INDEX), _index(0), _scratch(new byte[archive.options().bufferSize])
+{
+  /* TODO: need to fix const-cast */
+  _env = { const_cast<Archive*>(&_archive), &r, filter_repository::instance() };
+  
+  /* a stream without seek points is a single segment */
+  if (stream.isSeekable())
+    _segments = stream.seekPoints();
+  else
+    _segments.push_back({ 0, 0, 0, 0 });
+  
+  _stream.filters().unsetup(_env);
+}
+
+size_t ArchiveStreamReader::segmentFor(size_t index) const
+{
+  auto it = std::upper_bound(_segments.begin(), _segments.end(), index, [] (size_t index, const box::SeekPoint& point) {
+    return index < point.indexInStream;
+  });
+  
+  assert(it != _segments.begin());
+  return std::distance(_segments.begin(), it) - 1;
+}
+
+size_t ArchiveStreamReader::segmentEnd(size_t segment) const
+{
+  return segment + 1 < _segments.size() ? _segments[segment + 1].indexInStream : _stream.entries().size();
+}
+
+void ArchiveStreamReader::openSegment(size_t segment)
+{
+  const size_t offset = _stream.binary().offset + _segments[segment].offset;
+  
+  TRACE_A("%p: archive::extract() decoding segment %lu of stream at %Xh (%lu)", this, segment, offset, offset);
+  
+  _streamCache.clear();
+  
+  _start.reset(new lambda_init_data_source<data_source>(&r, [this, offset] () { r.seek(offset); }));
+  _streamCache.setSource(_start.get());
+  _stream.filters().unapply(_streamCache);
+  
+  _segment = segment;
+}
+
+void ArchiveStreamReader::skipRemaining()
+{
+  if (!_bounded)
+    return;
+  
+  /* entry filters could finish before their input so what's left must be skipped to reach next entry */
+  while (_bounded->read(_scratch.get(), _archive.options().bufferSize) != END_OF_STREAM) ;
+  
+  if (_bounded->remaining() > 0)
+    throw exceptions::file_format_error(fmt::sprintf("stream ended before end of entry %s", entry().name().data()));
+  
+  _entryCache.clear();
+  _bounded.reset();
+}
+
+const ArchiveEntry& ArchiveStreamReader::entry() const
+{
+  assert(_index > 0);
+  return _archive.entries()[_stream.entries()[_index - 1]];
+}
+
+data_source* ArchiveStreamReader::next()
+{
+  skipRemaining();
+  
+  if (_index >= _stream.entries().size())
+    return nullptr;
+  
+  size_t segment = segmentFor(_index);
+  if (segment != _segment)
+    openSegment(segment);
+  
+  const ArchiveEntry& current = _archive.entries()[_stream.entries()[_index++]];
+  
+  _bounded.reset(new bounded_data_source(_streamCache.get(), current.binary().filteredSize));
+  
+  _entryCache.setSource(_bounded.get());
+  current.filters().unsetup(_env);
+  current.filters().unapply(_entryCache);
+  
+  return _entryCache.get();
+}
+
+void ArchiveStreamReader::extract(const entry_sink_factory& sinks)
+{
+  const auto& entries = _stream.entries();
+  const size_t bufferSize = _archive.options().bufferSize;
+  
+  skipRemaining();
+  
+  while (_index < entries.size())
+  {
+    const size_t segment = segmentFor(_index);
+    const size_t end = segmentEnd(segment);
+    
+    const bool unfiltered = _index == _segments[segment].indexInStream && std::all_of(entries.begin() + _index, entries.begin() + end, [this] (ArchiveEntry::ref ref) {
+      return _archive.entries()[ref].filters().empty();
+    });
+    
+    if (unfiltered)
+    {
+      /* whole segment is decoded through a single pipe which switches sink at each entry boundary */
+      openSegment(segment);
+      
+      std::vector<size_t> sizes;
+      std::transform(entries.begin() + _index, entries.begin() + end, std::back_inserter(sizes), [this] (ArchiveEntry::ref ref) {
+        return _archive.entries()[ref].binary().filteredSize;
+      });
+      
+      size_t next = _index;
+      multiple_fixed_size_sink_policy policy([this, &sinks, &entries, &next] () {
+        return sinks(_archive.entries()[entries[next++]]).release();
+      }, sizes);
+      
+      multiple_data_sink sink(&policy);
+      bounded_data_source source(_streamCache.get(), std::accumulate(sizes.begin(), sizes.end(), 0UL));
+      
+      passthrough_pipe pipe(&source, &sink, bufferSize);
+      pipe.process();
+      
+      if (source.remaining() > 0 || next != end)
+        throw exceptions::file_format_error("stream ended before end of its entries");
+      
+      _index = end;
+    }
+    else
+    {
+      data_source* source = next();
+      std::unique_ptr<data_sink> sink = sinks(entry());
+      
+      passthrough_pipe pipe(source, sink.get(), bufferSize);
+      pipe.process();
+    }
+  }
+  
+  skipRemaining();
+}
@@ -3,16 +3,53 @@
 #include "tbx/base/common.h"
 
 #include "tbx/streams/data_source.h"
+#include "tbx/streams/data_writer.h"
 
 #include "filter_queue.h"
 #include "header.h"
 
 #include <list>
+#include <string_view>
+#include <utility>
 
 class memory_buffer;
-using W = memory_buffer;
+using W = data_writer;
 using R = seekable_data_source;
 
+/* bytes of a region of the archive, shared in place when the source is mapped in memory
+   or read with a single bulk read otherwise, either way they stay valid after the source is gone */
+class region_view
+{
+private:
+  std::shared_ptr<const byte> _data;
+  roff_t _offset;
+  size_t _length;
+  
+public:
+  region_view() : _offset(0), _length(0) { }
+  region_view(const std::shared_ptr<const byte>& data, roff_t offset, size_t length) : _data(data), _offset(offset), _length(length) { }
+  region_view(R& r, roff_t offset, size_t length);
+  
+  /* value at offset relative to the region */
+  template<typename T> T at(size_t offset) const
+  {
+    T value;
+    std::memcpy(&value, _data.get() + offset, sizeof(T));
+    return value;
+  }
+  
+  /* NUL terminated string starting at offset relative to the region, viewed in place */
+  std::string_view string(size_t offset) const;
+  
+  /* data at an absolute offset in the archive, which must be inside the region */
+  const byte* data(roff_t offset, size_t length) const;
+  bool contains(roff_t offset, size_t length) const { return offset >= _offset && offset + length <= _offset + _length; }
+  
+  const byte* data() const { return _data.get(); }
+  roff_t offset() const { return _offset; }
+  size_t length() const { return _length; }
+};
+
 template<typename ENV>
 class FilteredEntry
 {
@@ -23,9 +60,10 @@ private:
 public:
   FilteredEntry() { }
   FilteredEntry(const std::vector<filter_builder*>& filters) : _filters(filters) { }
-  FilteredEntry(const std::vector<byte>& payload) : _payload(payload.size())
+  FilteredEntry(const byte* payload, size_t length)
   {
-    _payload.write(payload.data(), payload.size());
+    if (length > 0)
+      _payload.write(payload, length);
   }
   
   box::count_t payloadLength() const
@@ -50,33 +88,58 @@ public:
   
   void addFilter(filter_builder* builder) { _filters.add(builder); }
   const filter_builder_queue& filters() const { return _filters; }
+  
+protected:
+  void setPayload(const byte* data, size_t length) { _payload = memory_buffer(data, length); }
 };
 
+struct lazy_entry_tables;
+
 class ArchiveEntry : public FilteredEntry<archive_environment>
 {
 public:
   using ref = box::index_t;
   
 private:
-  mutable box::Entry _binary;
+  /* record viewed in place in the entry table of the archive it's been read from,
+     it's copied into _binary only when the entry is modified */
+  const box::Entry* _record;
+  box::Entry _binary;
   
   /* TODO: manage data ownership */
   data_source* _source;
   std::string _name;
+  /* name viewed in place in the file name table until it's changed */
+  std::string_view _tableName;
   std::string _comment;
+  
+  /* while set name and filters have not been loaded yet, loading is not synchronized
+     so the same entry must not be accessed for the first time by multiple threads */
+  mutable const lazy_entry_tables* _tables;
+  
+  void load() const;
 
 public:
-  ArchiveEntry(const std::string& name, const box::Entry& binary, const std::vector<byte>& payload) : FilteredEntry<archive_environment>(payload),
-    _name(name), _source(nullptr), _binary(binary)
+  ArchiveEntry(const box::Entry* record, const lazy_entry_tables* tables) : _record(record), _source(nullptr), _tables(tables)
   {
 
   }
   
-  ArchiveEntry(const std::string& name, data_source* source, const std::vector<filter_builder*>& filters) : FilteredEntry<archive_environment>(filters), _source(source), _name(name) { }
-  ArchiveEntry(const std::string& name, data_source* source) : _source(source), _name(name) { }
+  ArchiveEntry(const std::string& name, data_source* source, const std::vector<filter_builder*>& filters) : FilteredEntry<archive_environment>(filters), _record(nullptr), _source(source), _name(name), _tables(nullptr) { }
+  ArchiveEntry(const std::string& name, data_source* source) : _record(nullptr), _source(source), _name(name), _tables(nullptr) { }
   
-  void setName(const std::string& name) { this->_name = name; }
-  const std::string& name() const { return _name; }
+  void setName(const std::string& name) { load(); this->_name = name; _tableName = std::string_view(); }
+  std::string_view name() const { load(); return _tableName.data() ? _tableName : std::string_view(_name); }
+  
+  box::count_t payloadLength() const { load(); return FilteredEntry<archive_environment>::payloadLength(); }
+  const memory_buffer& payload() const { load(); return FilteredEntry<archive_environment>::payload(); }
+  void serializePayload(const archive_environment& env) const { load(); FilteredEntry<archive_environment>::serializePayload(env); }
+  void addFilter(filter_builder* builder) { load(); FilteredEntry<archive_environment>::addFilter(builder); }
+  const filter_builder_queue& filters() const { load(); return FilteredEntry<archive_environment>::filters(); }
+  
+  bool isLoaded() const { return _tables == nullptr; }
+  /* name is still the one stored in the file name table of the archive the entry has been read from */
+  bool hasTableName() const { return _tables || _tableName.data(); }
 
   void setComment(const std::string& comment) { this->_comment = comment; }
   const std::string& comment() const { return _comment; }
@@ -90,7 +153,19 @@ public:
     _binary.indexInStream = indexInStream;
   }
   
-  box::Entry& binary() const { return _binary; }
+  bool isDuplicate() const { return binary().original != box::INVALID_INDEX; }
+  
+  const box::Entry& binary() const { return _record ? *_record : _binary; }
+  box::Entry& binary()
+  {
+    if (_record)
+    {
+      _binary = *_record;
+      _record = nullptr;
+    }
+    
+    return _binary;
+  }
 };
 
 class ArchiveStream : public FilteredEntry<archive_environment>
@@ -99,23 +174,57 @@ public:
   using ref = box::index_t;
   
 private:
-  mutable box::Stream _binary;
+  /* record viewed in place in the stream table, copied into _binary only when the stream is modified */
+  const box::Stream* _record;
+  box::Stream _binary;
   std::vector<ArchiveEntry::ref> _entries;
+  
+  /* archive this stream has been read from, while the stream is left untouched
+     its filtered data is copied verbatim from there when written */
+  R* _origin;
+  box::offset_t _originOffset;
+  box::length_t _originLength;
+  
+  std::vector<box::SeekPoint> _seekPoints;
 
 public:
-  ArchiveStream(const std::vector<ArchiveEntry::ref>& indices, const std::vector<filter_builder*>& filters) : FilteredEntry<archive_environment>(filters), _entries(indices) { }
-  ArchiveStream(ArchiveEntry::ref entry) { assignEntry(entry); }
-  ArchiveStream() { }
-  ArchiveStream(const box::Stream& binary, const std::vector<byte>& payload) : FilteredEntry<archive_environment>(payload), _binary(binary)
+  ArchiveStream(const std::vector<ArchiveEntry::ref>& indices, const std::vector<filter_builder*>& filters) : FilteredEntry<archive_environment>(filters), _record(nullptr), _binary(), _entries(indices), _origin(nullptr), _originOffset(0), _originLength(0) { }
+  ArchiveStream(ArchiveEntry::ref entry) : _record(nullptr), _binary(), _origin(nullptr), _originOffset(0), _originLength(0) { assignEntry(entry); }
+  ArchiveStream() : _record(nullptr), _binary(), _origin(nullptr), _originOffset(0), _originLength(0) { }
+  ArchiveStream(const box::Stream* record, const byte* payload) : FilteredEntry<archive_environment>(payload, record->payloadLength), _record(record), _binary(), _origin(nullptr), _originOffset(0), _originLength(0)
   {
   }
   
-  void assignEntry(ArchiveEntry::ref entry) { _entries.push_back(entry); }
+  void setOrigin(R* origin) { _origin = origin; _originOffset = std::as_const(*this).binary().offset; _originLength = std::as_const(*this).binary().length; }
+  R* origin() const { return _origin; }
+  box::offset_t originOffset() const { return _originOffset; }
+  box::length_t originLength() const { return _originLength; }
+  bool hasOrigin() const { return _origin != nullptr; }
+  
+  /* modifying the stream means that its data must be encoded again */
+  void addFilter(filter_builder* builder) { _origin = nullptr; FilteredEntry<archive_environment>::addFilter(builder); }
+  void assignEntry(ArchiveEntry::ref entry) { _origin = nullptr; _entries.push_back(entry); }
+  void removeEntry(ArchiveEntry::ref entry) { _origin = nullptr; _entries.erase(std::remove(_entries.begin(), _entries.end(), entry), _entries.end()); }
   void assignEntryAtIndex(size_t index, ArchiveEntry::ref entry) { _entries.resize(index+1, box::INVALID_INDEX); _entries[index] = entry; }
   
   const std::vector<ArchiveEntry::ref>& entries() const { return _entries; }
   
-  box::Stream& binary() const { return _binary; }
+  void addSeekPoint(const box::SeekPoint& point) { _seekPoints.push_back(point); }
+  void clearSeekPoints() { _seekPoints.clear(); }
+  const std::vector<box::SeekPoint>& seekPoints() const { return _seekPoints; }
+  bool isSeekable() const { return (binary().flags && box::StreamFlag::SEEKABLE) && !_seekPoints.empty(); }
+  
+  const box::Stream& binary() const { return _record ? *_record : _binary; }
+  box::Stream& binary()
+  {
+    if (_record)
+    {
+      _binary = *_record;
+      _record = nullptr;
+    }
+    
+    return _binary;
+  }
 };
 
 class ArchiveGroup
@@ -149,6 +258,8 @@ struct Options
     bool crc32;
     bool md5;
     bool sha1;
+    /* each digest is computed on its own thread */
+    bool parallel;
   } digest;
   
   struct
@@ -157,11 +268,76 @@ struct Options
     size_t digesterBuffer;
   } checksum;
   
-  Options() : bufferSize(16), digest({true, true, true}), checksum({true, MB1}) { }
+  /* amount of worker threads used to encode or extract streams, 1 means everything is done on calling thread */
+  size_t threads;
+  
+  /* reading, hashing and filtering of each stream run as separate threaded stages */
+  bool pipelined;
   
-  bool isMultithreaded() const { return false; }
+  /* memory used to hold streams encoded on worker threads, past it they're spilled to temporary files */
+  size_t memoryBudget;
+  
+  /* entries with same size and sha1 of a previous one share its data instead of being stored again */
+  bool deduplicate;
+  
+  /* stream filters are restarted at the first entry boundary after this amount of data so that an entry
+     can be read starting from the nearest seek point, 0 means that streams are solid */
+  size_t seekInterval;
+  
+  /* threads used to decode a single stream, both for block compressed streams and multithreaded lzma decoder,
+     past memory limit lzma decoder falls back to a single thread, these are picked up when archive is read */
+  size_t decoderThreads;
+  size_t decoderMemoryLimit;
+  
+  /* entries are read from the entry table without their names and filters, which are loaded
+     when each entry is first accessed */
+  bool lazyEntries;
+  
+  /* a hash index of entry names is written so that entries can be found by name without scanning them */
+  bool nameIndex;
+  
+  /* entries are indexed by crc32 and by sha1 so that they can be found by digest with a binary search */
+  bool digestIndex;
+  
+  /* memory used to keep decoded entries which are sources of other ones (eg. xdelta3 bases) while extracting,
+     past it unused ones are dropped or moved to temporary files if spilling is enabled */
+  struct
+  {
+    size_t budget;
+    bool spill;
+  } sourceCache;
+  
+  /* sources larger than threshold are never decoded whole, they're read through a bounded amount of pages decoded on demand */
+  struct
+  {
+    size_t threshold;
+    size_t pageSize;
+    size_t pages;
+  } sourcePaging;
+  
+  Options() : bufferSize(16), digest({true, true, true, false}), checksum({true, MB1}), threads(1), pipelined(false), memoryBudget(GB1), deduplicate(false), seekInterval(0),
+    decoderThreads(1), decoderMemoryLimit(GB1), lazyEntries(false), nameIndex(false), digestIndex(false), sourceCache({GB1, false}), sourcePaging({GB1, MB1, 64}) { }
+  
+  bool isMultithreaded() const { return threads > 1; }
 };
 
+/* tables from which names and payloads of entries are loaded, filters are built with repository and options
+   in effect when the archive has been read so that entries don't depend on the Archive, which can be moved in the meanwhile */
+struct lazy_entry_tables
+{
+  region_view names;
+  region_view payloads;
+  
+  Options options;
+  archive_environment env;
+  
+  lazy_entry_tables(const Options& options, const filter_repository* repository) : options(options),
+    env{ nullptr, { nullptr }, repository, &this->options } { }
+};
+
+using entry_sink_factory = std::function<std::unique_ptr<data_sink>(const ArchiveEntry& entry)>;
+using reader_factory = std::function<std::unique_ptr<R>()>;
+
 class Archive;
 
 class ArchiveReadHandle : public data_source
@@ -175,12 +351,49 @@ private:
   data_source* _source;
   
 public:
-  ArchiveReadHandle(R& r, const Archive& archive, const ArchiveEntry& entry) : r(r), _archive(archive), _entry(entry), _source(nullptr) { }
+  ArchiveReadHandle(R& r, const Archive& archive, const ArchiveEntry& entry);
   data_source* source(bool total);
   
   size_t read(byte* dest, size_t amount) { return _source->read(dest, amount); }
 };
 
+/* reads all entries of a stream in order while decoding it only once, stream filters are unapplied once
+   for each segment between seek points and entry filters are unapplied on the range of each entry */
+class ArchiveStreamReader
+{
+private:
+  R& r;
+  archive_environment _env;
+  const Archive& _archive;
+  const ArchiveStream& _stream;
+  
+  std::vector<box::SeekPoint> _segments;
+  size_t _segment;
+  size_t _index;
+  
+  std::unique_ptr<data_source> _start;
+  filter_cache _streamCache;
+  std::unique_ptr<bounded_data_source> _bounded;
+  filter_cache _entryCache;
+  std::unique_ptr<byte[]> _scratch;
+  
+  size_t segmentFor(size_t index) const;
+  size_t segmentEnd(size_t segment) const;
+  void openSegment(size_t segment);
+  void skipRemaining();
+  
+public:
+  ArchiveStreamReader(R& r, const Archive& archive, const ArchiveStream& stream);
+  
+  /* source of next entry, what's left of previous one is skipped, nullptr when there are no more entries */
+  data_source* next();
+  const ArchiveEntry& entry() const;
+  
+  /* writes all remaining entries each into its own sink, segments whose entries have no filters
+     are split into sinks while being decoded without building a source for each entry */
+  void extract(const entry_sink_factory& sinks);
+};
+
 struct ArchiveFactory
 {
   struct Entry
@@ -226,20 +439,49 @@ private:
   std::vector<ArchiveStream> _streams;
   std::vector<ArchiveGroup> _groups;
   
+  /* tables of the archive which has been read, entries and streams point into them */
+  std::vector<region_view> _tables;
+  std::shared_ptr<lazy_entry_tables> _lazyTables;
+  
+  /* decoded sources shared by entries of this archive for its whole lifetime */
+  std::shared_ptr<decoded_source_cache> _sourceCache;
+  
+  /* indices of the archive which has been read, dropped as soon as entries are added */
+  region_view _nameIndex;
+  region_view _digestIndex;
+  
+  template<typename K, typename C> std::vector<ArchiveEntry::ref> findInDigestIndex(size_t base, const K& key, C compare) const;
+  const ArchiveEntry* findSource(const box::DigestInfo& digest, std::vector<box::DigestInfo>& chain) const;
+  
   std::unordered_map<box::Section, box::SectionHeader, enum_hash> _headers;
   
   std::list<box::Section> _ordering;
   
-  void finalizeHeader(W& w);
+  void finalizeHeader(size_t fileLength, box::checksum_t dataChecksum);
+  box::checksum_t headerChecksum() const;
+  box::checksum_t globalChecksum(box::checksum_t dataChecksum, size_t dataLength) const;
+  box::checksum_t dataChecksum(W& w, size_t bufferSize) const;
   box::checksum_t calculateGlobalChecksum(W& w, size_t bufferSize) const;
   
   bool willSectionBeSerialized(box::Section section) const;
+  static size_t nameIndexSlots(size_t entries);
   
-  void writeStream(W& w, ArchiveStream& stream);
+  void deduplicate(size_t firstStream);
+  void writeSections(W& w, size_t firstStream);
+  void writeStream(data_sink& w, ArchiveStream& stream);
+  void copyStream(data_sink& w, const ArchiveStream& stream);
+  void writeStreamsConcurrently(W& w, size_t firstStream);
   void writeEntryPayloads(W& w);
   void writeStreamPayloads(W& w);
   
+  region_view sectionRegion(R& r, box::Section section) const;
   void readSection(R& r, const box::SectionHeader& header);
+  void readSeekTable(R& r, const box::SectionHeader& header);
+  
+  using duplicates_map = std::unordered_map<ArchiveEntry::ref, std::vector<ArchiveEntry::ref>>;
+  void extractStream(R& r, const ArchiveStream& stream, const entry_sink_factory& sinks, const duplicates_map& duplicates) const;
+  
+  bool hasExternalDependencies(const ArchiveStream& stream) const;
   
   const ArchiveEntry& entryForRef(ArchiveEntry::ref ref) const { return _entries[ref]; }
   ArchiveEntry& entryForRef(ArchiveEntry::ref ref) { return _entries[ref]; }
@@ -250,6 +492,18 @@ public:
   void write(W& w);
   void read(R& r);
   
+  /* adds entries and streams of data, indices in data are relative to its own entries */
+  void add(const ArchiveFactory::Data& data);
+  
+  /* adds data to an archive previously read from w by writing only new streams and fresh tables at its end,
+     space used by previous tables is not reclaimed until the archive is written again */
+  void append(W& w, const ArchiveFactory::Data& data);
+  
+  /* decodes each stream of an archive read from r once and writes its entries in order to the sinks built by the factory,
+     when multithreaded and a reader factory is provided independent streams are extracted concurrently each from its own
+     reader, so sink factory must be thread safe */
+  void extract(R& r, const entry_sink_factory& sinks, const reader_factory& readers = nullptr);
+  
   const box::Header& header() const { return _header; }
   const decltype(_headers)& sections() const { return _headers; }
   const box::SectionHeader* section(box::Section section) const
@@ -260,6 +514,8 @@ public:
 
   Options& options() { return _options; }
   const Options& options() const { return _options; }
+  
+  decoded_source_cache& sourceCache() const;
 
   ArchiveSizeInfo sizeInfo() const;
   
@@ -270,6 +526,22 @@ public:
   const decltype(_entries)& entries() const { return _entries; }
   const decltype(_streams)& streams() const { return _streams; }
   
+  /* first entry with given name or nullptr, through the name index when archive has been read with one,
+     so that with lazy entries only the entries whose name hash collides are loaded, entries renamed
+     after reading are unknown to the index and are scanned when it misses */
+  const ArchiveEntry* find(const std::string& name) const;
+  
+  /* entries with given digest through the digest index when archive has been read with one, only entry
+     records are needed so lazy entries are not loaded, matching by full digest returns the first one */
+  std::vector<ArchiveEntry::ref> findByDigest(hash::crc32_t crc32) const;
+  std::vector<ArchiveEntry::ref> findByDigest(const hash::sha1_t& sha1) const;
+  const ArchiveEntry* findByDigest(const box::DigestInfo& digest) const;
+  
+  /* entry to decode to obtain data with given digest, which can itself be a delta against another entry: entries
+     which don't depend on others are preferred, then the ones whose chain of sources ends on such an entry without
+     coming back to a digest already in the chain, nullptr if there's none */
+  const ArchiveEntry* findSource(const box::DigestInfo& digest) const;
+  
   static Archive ofSingleEntry(const std::string& name, seekable_data_source* source, const std::initializer_list<filter_builder*>& builders);
   static Archive ofOneEntryPerStream(const std::vector<std::tuple<std::string, seekable_data_source*>>& entries, std::initializer_list<filter_builder*> builders);
   static Archive ofData(const ArchiveFactory::Data& data);
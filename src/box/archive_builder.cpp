@@ -1,6 +1,65 @@
 #include "archive_builder.h"
 
 #include "tbx/base/file_system.h"
+#include "tbx/streams/chunked_memory_buffer.h"
+#include "tbx/streams/memory_mapped_data_source.h"
+
+#include "similarity.h"
+
+#include <atomic>
+#include <numeric>
+
+namespace
+{
+  /* forwards to another writer and gives up by throwing as soon as data written exceeds a limit,
+     which is shared between concurrent trials and lowered while they find smaller archives */
+  class size_limited_writer : public data_writer
+  {
+  private:
+    data_writer& _writer;
+    const std::atomic<size_t>& _limit;
+    
+    void check() const
+    {
+      if (_writer.size() > _limit.load(std::memory_order_relaxed))
+        throw exceeded();
+    }
+    
+  public:
+    struct exceeded { };
+    
+    using data_writer::write;
+    using data_writer::reserve;
+    
+    size_limited_writer(data_writer& writer, const std::atomic<size_t>& limit) : _writer(writer), _limit(limit) { }
+    
+    size_t write(const void* data, size_t size, size_t count) override
+    {
+      size_t written = _writer.write(data, size, count);
+      check();
+      return written;
+    }
+    
+    size_t write(const byte* src, size_t amount) override
+    {
+      size_t written = _writer.write(src, amount);
+      check();
+      return written;
+    }
+    
+    size_t read(void* data, size_t size, size_t count) override { return _writer.read(data, size, count); }
+    
+    void seek(roff_t offset, Seek origin) override { _writer.seek(offset, origin); }
+    roff_t tell() const override { return _writer.tell(); }
+    size_t size() const override { return _writer.size(); }
+    
+    void reserve(size_t size) override
+    {
+      _writer.reserve(size);
+      check();
+    }
+  };
+}
 
 filter_builder* ArchiveBuilder::buildLZMA(const data_source_vector& sources)
 {
@@ -97,6 +156,13 @@ Archive ArchiveBuilder::buildSingleStreamSolidArchive(const data_source_vector&
 
 Archive ArchiveBuilder::buildSingleStreamBaseWithDeltasArchive(const data_source_vector& sources, size_t baseIndex)
 {
+  return buildBaseWithDeltasArchive(sources, std::vector<size_t>(sources.size(), baseIndex));
+}
+
+Archive ArchiveBuilder::buildBaseWithDeltasArchive(const data_source_vector& sources, const std::vector<size_t>& bases)
+{
+  assert(bases.size() == sources.size());
+  
   size_t bufferSize = filterBufferSizeForPolicy(sources);
 
   ArchiveFactory::Data data;
@@ -104,6 +170,7 @@ Archive ArchiveBuilder::buildSingleStreamBaseWithDeltasArchive(const data_source
   for (box::index_t i = 0; i < sources.size(); ++i)
   {
     const auto& source = sources[i];
+    const size_t baseIndex = bases[i];
     
     source->rewind();
     if (i == baseIndex)
@@ -119,6 +186,154 @@ Archive ArchiveBuilder::buildSingleStreamBaseWithDeltasArchive(const data_source
   return Archive::ofData(data);
 }
 
+Archive ArchiveBuilder::buildClusteredDeltaArchive(const data_source_vector& sources, float threshold)
+{
+  TRACE_AB("%p: builder::clusteredDeltaArchive() clustering %lu sources", this, sources.size());
+  
+  std::vector<std::shared_ptr<const byte>> held;
+  std::vector<const byte*> views = viewsOf(sources, held);
+  
+  const size_t averageChunk = similarity::sample::averageChunkFor(maxBufferSize(sources));
+  std::vector<similarity::signature> signatures;
+  for (size_t i = 0; i < sources.size(); ++i)
+    signatures.push_back(similarity::signature::of(similarity::sample::of(views[i], sources[i]->size(), averageChunk)));
+  
+  std::vector<size_t> bases(sources.size());
+  
+  for (const auto& cluster : similarity::cluster(signatures, threshold))
+  {
+    /* base is the member which resembles the others the most, signatures have fixed size so this doesn't depend on data length */
+    size_t base = cluster.front();
+    float bestScore = -1.0f;
+    
+    for (size_t candidate : cluster)
+    {
+      float score = 0.0f;
+      for (size_t other : cluster)
+        if (other != candidate)
+          score += signatures[candidate].resemblance(signatures[other]) * sources[other]->size();
+      
+      if (score > bestScore)
+      {
+        bestScore = score;
+        base = candidate;
+      }
+    }
+    
+    TRACE_AB("%p: builder::clusteredDeltaArchive() cluster of %lu sources with base %s", this, cluster.size(), sources[base].name.c_str());
+    
+    for (size_t member : cluster)
+      bases[member] = base;
+  }
+  
+  for (const auto& source : sources)
+    source->rewind();
+  
+  return buildBaseWithDeltasArchive(sources, bases);
+}
+
+Archive ArchiveBuilder::buildDeltaChainArchive(const data_source_vector& sources)
+{
+  TRACE_AB("%p: builder::deltaChainArchive() building delta tree of %lu sources", this, sources.size());
+  
+  std::vector<std::shared_ptr<const byte>> held;
+  std::vector<const byte*> views = viewsOf(sources, held);
+  
+  const size_t averageChunk = similarity::sample::averageChunkFor(maxBufferSize(sources));
+  std::vector<similarity::signature> signatures;
+  for (size_t i = 0; i < sources.size(); ++i)
+    signatures.push_back(similarity::signature::of(similarity::sample::of(views[i], sources[i]->size(), averageChunk)));
+  
+  /* delta cost is estimated as the data not shared according to signatures, storing a source on its own costs its whole
+     size: this is an edge to a virtual root so the spanning tree of the sources from it chooses which ones are stored
+     as they are, the tree is built with Prim's algorithm which is quadratic in sources but works on fixed size signatures */
+  auto cost = [&sources, &signatures] (size_t i, size_t j) {
+    return (1.0f - signatures[i].resemblance(signatures[j])) * std::max(sources[i]->size(), sources[j]->size());
+  };
+  
+  std::vector<size_t> bases(sources.size());
+  std::vector<float> distances(sources.size());
+  std::vector<bool> inTree(sources.size(), false);
+  
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+    bases[i] = i;
+    distances[i] = static_cast<float>(sources[i]->size());
+  }
+  
+  for (size_t step = 0; step < sources.size(); ++step)
+  {
+    size_t next = sources.size();
+    for (size_t i = 0; i < sources.size(); ++i)
+      if (!inTree[i] && (next == sources.size() || distances[i] < distances[next]))
+        next = i;
+    
+    inTree[next] = true;
+    
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+      if (!inTree[i])
+      {
+        const float distance = cost(next, i);
+        
+        if (distance < distances[i])
+        {
+          distances[i] = distance;
+          bases[i] = next;
+        }
+      }
+    }
+  }
+  
+  for (const auto& source : sources)
+    source->rewind();
+  
+  return buildBaseWithDeltasArchive(sources, bases);
+}
+
+std::vector<const byte*> ArchiveBuilder::viewsOf(const data_source_vector& sources, std::vector<std::shared_ptr<const byte>>& held)
+{
+  std::vector<const byte*> views;
+  
+  for (const auto& source : sources)
+  {
+    held.push_back(source->view(0, source->size()));
+    const byte* view = held.back().get();
+    
+    /* memory buffers are left untouched while building so their data is used directly */
+    if (!view)
+    {
+      if (const memory_buffer* buffer = dynamic_cast<const memory_buffer*>(source.source.get()))
+        view = buffer->raw();
+    }
+    
+    if (!view)
+    {
+      byte* data = new byte[source->size()];
+      held.back().reset(data, std::default_delete<byte[]>());
+      source->rewind();
+      
+      /* sources can return less than requested, a source which ends early can't be sampled */
+      for (size_t total = 0; total < source->size(); )
+      {
+        size_t read = source->read(data + total, source->size() - total);
+        
+        if (read == 0 || read == END_OF_STREAM)
+          throw exceptions::error_reading_from_file(path(source.name));
+        
+        total += read;
+      }
+      
+      source->rewind();
+      view = data;
+    }
+    
+    views.push_back(view);
+  }
+  
+  return views;
+}
+
 Archive ArchiveBuilder::buildSolidArchivePerFolderOfDirectoryTree(const path& root)
 {
   TRACE_AB("%p: builder::solidArchiveOfDirectoryTree(): %s", this, root.c_str());
@@ -138,29 +353,88 @@ Archive ArchiveBuilder::buildSolidArchivePerFolderOfDirectoryTree(const path& ro
   return Archive::ofData(data);
 }
 
-Archive ArchiveBuilder::buildBestSingleStreamDeltaArchive(const data_source_vector& sources)
+Archive ArchiveBuilder::buildBestSingleStreamDeltaArchive(const data_source_vector& sources, size_t maxCandidates)
 {
-  TRACE_AB("%p: builder::bestDeltaArchive()", this, sources.size());
+  TRACE_AB("%p: builder::bestDeltaArchive() choosing base among %lu sources", this, sources.size());
   
-  //TODO: totally unoptmized for now
-  size_t index = 0;
-  size_t size = std::numeric_limits<size_t>::max();
+  if (sources.empty())
+    return buildSingleStreamBaseWithDeltasArchive(sources, 0);
   
+  /* trials run concurrently so each one reads sources through its own views of the same data */
+  std::vector<std::shared_ptr<const byte>> held;
+  std::vector<const byte*> views = viewsOf(sources, held);
+  
+  /* candidates which share most data with the others are tried first so that a small archive is found early
+     and most of the following trials are aborted soon */
+  const size_t averageChunk = similarity::sample::averageChunkFor(maxBufferSize(sources));
+  std::vector<similarity::sample> samples;
   for (size_t i = 0; i < sources.size(); ++i)
-  {
-    Archive archive = buildSingleStreamBaseWithDeltasArchive(sources, i);
-    // TODO: only in memory for now
-    memory_buffer buffer;
-    archive.write(buffer);
-    
-    if (buffer.size() < size)
+    samples.push_back(similarity::sample::of(views[i], sources[i]->size(), averageChunk));
+  
+  std::vector<float> scores(sources.size(), 0.0f);
+  for (size_t i = 0; i < sources.size(); ++i)
+    for (size_t j = i + 1; j < sources.size(); ++j)
     {
-      size = buffer.size();
-      index = i;
+      const float resemblance = samples[i].resemblance(samples[j]);
+      scores[i] += resemblance * sources[j]->size();
+      scores[j] += resemblance * sources[i]->size();
     }
+  
+  std::vector<size_t> candidates(sources.size());
+  std::iota(candidates.begin(), candidates.end(), 0);
+  std::stable_sort(candidates.begin(), candidates.end(), [&scores] (size_t i, size_t j) { return scores[i] > scores[j]; });
+  
+  if (maxCandidates > 0 && maxCandidates < candidates.size())
+    candidates.resize(maxCandidates);
+  
+  /* best size is shared so that trials give up as soon as they produce more than it */
+  std::atomic<size_t> best(std::numeric_limits<size_t>::max());
+  std::mutex lock;
+  size_t index = candidates.front();
+  
+  concurrency::thread_pool pool(std::min(concurrency::thread_pool::hardwareConcurrency(), candidates.size()));
+  std::vector<std::future<void>> trials;
+  
+  for (size_t candidate : candidates)
+  {
+    trials.push_back(pool.submit([this, &sources, &views, &best, &lock, &index, candidate] () {
+      data_source_vector trialSources;
+      for (size_t i = 0; i < sources.size(); ++i)
+        trialSources.emplace_back(std::string(sources[i].name), new memory_buffer(const_cast<byte*>(views[i]), sources[i]->size(), false));
+      
+      Archive archive = buildSingleStreamBaseWithDeltasArchive(trialSources, candidate);
+      chunked_memory_buffer buffer;
+      size_limited_writer writer(buffer, best);
+      
+      try
+      {
+        archive.write(writer);
+      }
+      catch (const size_limited_writer::exceeded&)
+      {
+        TRACE_AB("%p: builder::bestDeltaArchive(): base %s aborted past %s", this, sources[candidate].name.c_str(), strings::humanReadableSize(buffer.size(), false).c_str());
+        return;
+      }
+      
+      TRACE_AB("%p: builder::bestDeltaArchive(): base %s gives %s", this, sources[candidate].name.c_str(), strings::humanReadableSize(buffer.size(), false).c_str());
+      
+      /* on equal size the first source wins so that result doesn't depend on scheduling */
+      std::lock_guard<std::mutex> guard(lock);
+      if (buffer.size() < best || (buffer.size() == best && candidate < index))
+      {
+        best = buffer.size();
+        index = candidate;
+      }
+    }));
   }
   
-  TRACE_AB("%p builder::bestDeltaArchive(): Best base entry is %s, archive size is %s", this, sources[index].name.c_str(), strings::humanReadableSize(size, false).c_str());
+  for (auto& trial : trials)
+    trial.get();
+  
+  TRACE_AB("%p builder::bestDeltaArchive(): Best base entry is %s, archive size is %s", this, sources[index].name.c_str(), strings::humanReadableSize(best, false).c_str());
+  
+  for (const auto& source : sources)
+    source->rewind();
   
   return buildSingleStreamBaseWithDeltasArchive(sources, index);
 }
@@ -176,16 +450,16 @@ void ArchiveBuilder::extractSpecificFilesFromArchive(const class path& path, con
     throw exceptions::file_not_found(destination);
 
   Archive archive;
-  file_data_source source(path);
+  memory_mapped_data_source source(path);
   archive.options().bufferSize = MB64;
   archive.read(source);
 
   const auto& entry = archive.entries()[index];
-  TRACE_AB("%p: builder::extract() extracting entry %s (%s)", this, entry.name().c_str(), entry.filters().mnemonic(false).c_str());
+  TRACE_AB("%p: builder::extract() extracting entry %s (%s)", this, entry.name().data(), entry.filters().mnemonic(false).c_str());
   auto handle = ArchiveReadHandle(source, archive, entry);
   auto* entrySource = handle.source(true);
 
-  class path dest = destination.append(entry.name());
+  class path dest = destination.append(std::string(entry.name()));
   file_data_sink sink(dest);
 
   passthrough_pipe pipe(entrySource, &sink, _pipeBufferPolicy);
@@ -203,22 +477,20 @@ void ArchiveBuilder::extractWholeArchiveIntoFolder(const class path& path, const
     throw exceptions::file_not_found(destination);
   
   Archive archive;
-  file_data_source source(path);
-  archive.options().bufferSize = MB64;
+  memory_mapped_data_source source(path);
+  
+  /* each stream is decoded once, independent streams concurrently, so buffers are shared between threads */
+  const size_t threads = concurrency::thread_pool::hardwareConcurrency();
+  archive.options().threads = threads;
+  archive.options().bufferSize = std::max(MB1, MB64 / threads);
   archive.read(source);
   
-  for (const auto& entry : archive.entries())
-  {
-    TRACE_AB("%p: builder::extract() extracting entry %s (%s)", this, entry.name().c_str(), entry.filters().mnemonic(false).c_str());
-    auto handle = ArchiveReadHandle(source, archive, entry);
-    auto* entrySource = handle.source(true);
-    
-    class path dest = destination.append(entry.name());
-    file_data_sink sink(dest);
-    
-    passthrough_pipe pipe(entrySource, &sink, _pipeBufferPolicy);
-    pipe.process(entry.binary().digest.size);
-  }
+  archive.extract(source, [this, &destination] (const ArchiveEntry& entry) {
+    TRACE_AB("%p: builder::extract() extracting entry %s (%s)", this, entry.name().data(), entry.filters().mnemonic(false).c_str());
+    return std::unique_ptr<data_sink>(new file_data_sink(destination.append(std::string(entry.name()))));
+  }, [&path] () {
+    return std::unique_ptr<seekable_data_source>(new memory_mapped_data_source(path));
+  });
 }
 
 
@@ -97,6 +97,9 @@ private:
   filter_builder* buildLZMA(const data_source_vector& sources);
   filter_builder* buildDeflater(const data_source_vector& sources);
   
+  /* data of each source in place, sources which can't share it are loaded once, held keeps data alive while views are used */
+  std::vector<const byte*> viewsOf(const data_source_vector& sources, std::vector<std::shared_ptr<const byte>>& held);
+  
   enum class Log { LOG_INFO, LOG_ERROR };
   
   template<typename... Args> void log(Log log, const std::string& format, Args... args);
@@ -117,8 +120,18 @@ public:
   
   filter_builder* buildDefaultCompressor(const data_source_vector& sources);
   
-  Archive buildBestSingleStreamDeltaArchive(const data_source_vector& sources);
+  /* tries sources as base in order of sampled similarity to the others, trials run concurrently and are aborted
+     once they exceed the best archive found, maxCandidates limits how many are tried (0 for all of them) */
+  Archive buildBestSingleStreamDeltaArchive(const data_source_vector& sources, size_t maxCandidates = 0);
   Archive buildSingleStreamBaseWithDeltasArchive(const data_source_vector& sources, size_t baseIndex);
+  /* each source is stored as xdelta3 against source at bases[i], or compressed if it's its own base */
+  Archive buildBaseWithDeltasArchive(const data_source_vector& sources, const std::vector<size_t>& bases);
+  /* sources are clustered by minhash resemblance of their chunks and each member of a cluster is
+     stored as xdelta3 against the member which resembles the others the most */
+  Archive buildClusteredDeltaArchive(const data_source_vector& sources, float threshold = 0.3f);
+  /* sources are stored as a minimum spanning tree of estimated delta costs, so each one can be a delta against
+     another delta (eg. a chain of revisions) or stored on its own when no other source resembles it */
+  Archive buildDeltaChainArchive(const data_source_vector& sources);
   Archive buildSingleStreamSolidArchive(const data_source_vector& sources);
   Archive buildSolidArchivePerFolderOfDirectoryTree(const path& root);
   
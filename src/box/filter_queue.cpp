@@ -2,7 +2,7 @@
 
 #include "archive.h" /* needed for options() */
 
-const Options& archive_environment::options() const { return archive->options(); }
+const Options& archive_environment::options() const { return detachedOptions ? *detachedOptions : archive->options(); }
 
 #include <sstream>
 
@@ -20,12 +20,12 @@ const filter_repository* filter_repository::instance()
     
     repository.registerGenerator(builders::identifier::DEFLATE_FILTER, [] (const byte* payload, const archive_environment& env) {
       size_t bufferSize = env.options().bufferSize;
-      return new builders::deflate_builder(bufferSize);
+      return new builders::deflate_builder(bufferSize, payload, env.options().decoderThreads, env.options().decoderMemoryLimit);
     });
     
     repository.registerGenerator(builders::identifier::LZMA_FILTER, [] (const byte* payload, const archive_environment& env) {
       size_t bufferSize = env.options().bufferSize;
-      return new builders::lzma_builder(bufferSize);
+      return new builders::lzma_builder(bufferSize, payload, env.options().decoderThreads, env.options().decoderMemoryLimit);
     });
     
     repository.registerGenerator(builders::identifier::XDELTA3_FILTER, [] (const byte* payload, const archive_environment& env) {
@@ -104,9 +104,27 @@ data_source* builders::xdelta3_builder::apply(data_source* source) const
   return new source_filter<xdelta3_encoder>(source, _source, _bufferSize, _xdeltaWindowSize, _sourceBlockSize);
 }
 
+/* passes through a source it owns while keeping alive the cached source it reads from */
+class retaining_source : public data_source
+{
+private:
+  std::unique_ptr<data_source> _source;
+  decoded_source_cache::source_ref _retained;
+  
+public:
+  retaining_source(data_source* source, decoded_source_cache::source_ref&& retained) : _source(source), _retained(std::move(retained)) { }
+  size_t read(byte* dest, size_t amount) override { return _source->read(dest, amount); }
+};
+
 data_source* builders::xdelta3_builder::unapply(data_source* source) const
 {
-  return new source_filter<xdelta3_decoder>(source, _source, _bufferSize, _xdeltaWindowSize, _sourceBlockSize);
+  data_source* decoder = new source_filter<xdelta3_decoder>(source, _source, _bufferSize, _xdeltaWindowSize, _sourceBlockSize);
+  
+  /* once decoding is done the cached source can be evicted */
+  if (_sourceRef)
+    return new retaining_source(decoder, std::move(_sourceRef));
+  
+  return decoder;
 }
 
 void builders::xdelta3_builder::setup(const archive_environment& env)
@@ -125,13 +143,12 @@ void builders::xdelta3_builder::setup(const archive_environment& env)
   {
     TRACE_A("%p: xdelta3_builder::setup() caching source digest information", this);
     
-    auto source = _source;
+    /* with concurrent streams source is read through a slice which keeps its own position, slice must outlive digesting */
+    seekable_data_source* source = _source;
+    seekable_source_slice slice(_source);
     
     if (env.options().isMultithreaded())
-    {
-      seekable_source_slice slice(_source);
       source = &slice;
-    }
     
     unbuffered_source_filter<filters::data_counter> counter(source);
     unbuffered_source_filter<filters::multiple_digest_filter> digester(&counter);
@@ -143,36 +160,55 @@ void builders::xdelta3_builder::setup(const archive_environment& env)
   }
 }
 
+const ArchiveEntry* builders::xdelta3_builder::findSource(const archive_environment& env) const
+{
+  const ArchiveEntry* entry = env.archive->findSource(_sourceDigest);
+  
+  if (!entry && env.archive->findByDigest(_sourceDigest))
+    throw exceptions::unserialization_exception("source of entry is a delta chain which depends on itself");
+  else if (!entry)
+    throw exceptions::missing_source_file_exception("can't find required source file to rebuild entry");
+  
+  return entry;
+}
+
+/* source can be a delta itself, in that case it's decoded recursively while its own source is acquired, intermediate
+   sources are cached by digest like any other so each one is decoded once however many entries depend on it */
 void builders::xdelta3_builder::unsetup(const archive_environment& env)
 {
-  assert(_source == nullptr);
+  const auto& paging = env.options().sourcePaging;
+  const size_t length = _sourceDigest.size;
   
-  /* search for matching source between entries */
-  for (const auto& entry : env.archive->entries())
+  /* large bases are decoded lazily while delta is decoded, they're read through a slice since delta stream is read from the same reader */
+  if (length > paging.threshold)
   {
-    /* we found a matching source */
-    if (entry.binary().digest == _sourceDigest)
-    {
-      TRACE_A("%p: xdelta3_builder::unsetup() found matching source %s", this, entry.name().c_str());
-      
-      //TODO: multiple choices here, we could build a source which is read together with this one, cache it on memory, cache it on a file etc
-      memory_buffer* sink = new memory_buffer(entry.binary().digest.size);
-      ArchiveReadHandle handle = ArchiveReadHandle(*env.r, *env.archive, entry);
-      
-      //TODO: it could be lazy or not, but source not uses seek asynchronously
-
-      passthrough_pipe pipe(handle.source(true), sink, env.options().bufferSize);
-      pipe.process();
-      
-      _source = sink;
-      env.cache.emplace(std::make_pair(_sourceDigest, std::unique_ptr<seekable_data_source>(sink)));
-      
-      return;
-    }
+    const ArchiveEntry* entry = findSource(env);
+    
+    TRACE_A("%p: xdelta3_builder::unsetup() found matching source %s, reading it through pages", this, entry->name().data());
+    
+    auto slice = std::make_shared<seekable_source_slice>(env.r);
+    const Archive* archive = env.archive;
+    
+    _sourceRef = std::make_shared<paged_decoded_source>(length, paging.pageSize, paging.pages, [slice, archive, entry] () {
+      ArchiveReadHandle* handle = new ArchiveReadHandle(*slice, *archive, *entry);
+      handle->source(true);
+      return std::unique_ptr<data_source>(handle);
+    });
+    
+    _source = _sourceRef.get();
+    return;
   }
   
-  throw exceptions::missing_source_file_exception("can't find required source file to rebuild entry");
-  
-  //TODO: multiple ways to manage this
+  /* the base is decoded once and shared through the cache of the archive by all deltas against it */
+  _sourceRef = env.archive->sourceCache().acquire(_sourceDigest, [this, &env] (memory_buffer& sink) {
+    const ArchiveEntry* entry = findSource(env);
+    
+    TRACE_A("%p: xdelta3_builder::unsetup() found matching source %s", this, entry->name().data());
+    
+    ArchiveReadHandle handle = ArchiveReadHandle(*env.r, *env.archive, *entry);
+    passthrough_pipe pipe(handle.source(true), &sink, env.options().bufferSize);
+    pipe.process();
+  });
   
+  _source = _sourceRef.get();
 }
@@ -4,11 +4,13 @@
 #include "filters/filters.h"
 
 #include "header.h"
+#include "source_cache.h"
 #include <vector>
 #include <unordered_map>
 #include <numeric>
 
 class Archive;
+class ArchiveEntry;
 class Options;
 class filter_repository;
 struct archive_environment
@@ -17,12 +19,13 @@ struct archive_environment
   union
   {
     seekable_data_source* r;
-    memory_buffer* w;
+    data_writer* w;
   };
   
   const filter_repository* repository;
+  /* options of an environment which is not bound to an archive, archive options are used if not set */
+  const Options* detachedOptions;
   mutable std::unordered_map<data_source*, box::DigestInfo> digestCache;
-  mutable std::unordered_map<box::DigestInfo, std::unique_ptr<data_source>, box::DigestInfo::hash> cache;
   
   const Options& options() const;
     
@@ -43,6 +46,9 @@ public:
   
   virtual data_source* apply(data_source* source) const = 0;
   virtual data_source* unapply(data_source* source) const = 0;
+  
+  /* unapplies the filter so that its output starts at offset, offset is updated to what must still be skipped from the result */
+  virtual data_source* unapplyFrom(data_source* source, size_t& offset) const { return unapply(source); }
   virtual box::payload_uid identifier() const = 0;
   
   virtual memory_buffer payload() const = 0;
@@ -52,6 +58,12 @@ public:
   
   virtual void setup(const archive_environment& env) { }
   virtual void unsetup(const archive_environment& env) { }
+  
+  /* true if the filter reads data besides its source (eg. another entry) so it can't be run concurrently with other streams */
+  virtual bool hasExternalDependencies() const { return false; }
+  
+  /* digest of the entry the filter reads as source if it has one */
+  virtual const box::DigestInfo* sourceDigest() const { return nullptr; }
 };
 
 
@@ -73,6 +85,9 @@ private:
 public:
   filter_cache() : _source(nullptr), _tail(nullptr) { }
   filter_cache(data_source* source) : _source(source), _tail(source) { }
+  filter_cache(filter_cache&&) = default;
+  filter_cache& operator=(filter_cache&&) = default;
+  ~filter_cache() { clear(); }
   
   void setSource(data_source* source) { _source = source; _tail = source; }
   
@@ -88,14 +103,22 @@ public:
     _filters.push_back(std::unique_ptr<data_source>(_tail));
   }
   
+  void unapplyFrom(const filter_builder& builder, size_t& offset)
+  {
+    _tail = builder.unapplyFrom(_tail, offset);
+    _filters.push_back(std::unique_ptr<data_source>(_tail));
+  }
+  
   void cache(data_source* source)
   {
     _filters.push_back(std::unique_ptr<data_source>(source));
   }
   
+  /* released from last to first so that each filter outlives what reads from it */
   void clear()
   {
-    _filters.clear();
+    while (!_filters.empty())
+      _filters.pop_back();
   }
   
   data_source* get() { return _tail; }
@@ -173,6 +196,18 @@ public:
       cache.unapply(*(*it).get());
   }
   
+  /* only the first filter produces the final data so it's the only one which can start from offset */
+  void unapply(filter_cache& cache, size_t& offset) const
+  {
+    for (auto it = _builders.rbegin(); it != _builders.rend(); ++it)
+    {
+      if (std::next(it) == _builders.rend())
+        cache.unapplyFrom(*(*it).get(), offset);
+      else
+        cache.unapply(*(*it).get());
+    }
+  }
+  
   filter_cache apply(data_source* source) const
   {
     filter_cache cache = filter_cache(source);
@@ -189,6 +224,20 @@ public:
   
   std::string mnemonic(bool shortMode) const;
   
+  bool hasExternalDependencies() const
+  {
+    return std::any_of(_builders.begin(), _builders.end(), [] (const decltype(_builders)::value_type& builder) { return builder->hasExternalDependencies(); });
+  }
+  
+  /* digest of the first entry any of the filters reads as source */
+  const box::DigestInfo* sourceDigest() const
+  {
+    for (const auto& builder : _builders)
+      if (const box::DigestInfo* digest = builder->sourceDigest())
+        return digest;
+    return nullptr;
+  }
+  
   const decltype(_builders)::value_type& operator[](size_t index) const { return _builders[index]; }
   size_t size() const { return _builders.size(); }
   bool empty() const { return _builders.empty(); }
@@ -219,6 +268,7 @@ public:
 
 #include "filters/deflate_filter.h"
 #include "filters/lzma_filter.h"
+#include "filters/block_filter.h"
 
 namespace builders
 {
@@ -277,65 +327,109 @@ namespace builders
     }
   };
     
-  class deflate_builder : public filter_builder
+  /* compression filters can optionally work on blocks of fixed size which are compressed independently,
+     block size is stored in payload while block boundaries are stored in stream data together with blocks */
+  template<typename E, typename D, identifier IDENT>
+  class compression_builder : public filter_builder
   {
   private:
+    size_t _blockSize;
+    size_t _threads;
+    size_t _memoryLimit;
     
-  public:
-    deflate_builder(size_t bufferSize) : filter_builder(bufferSize) { }
-    
-    box::payload_uid identifier() const override { return identifier::DEFLATE_FILTER; }
-    std::string mnemonic(bool shortMode) const override { return "deflate"; }
-    
-    size_t payloadLength() const override { return 0; }
-    memory_buffer payload() const override { return memory_buffer(0); }
+    /* decoders which are able to use multiple threads by themselves on a solid stream receive them */
+    data_source* solidDecoder(data_source* source, compression::lzma_decoder*) const
+    {
+      if (_threads > 1)
+        return new compression::lzma_mt_decoder(source, _bufferSize, options::LZMADecoder{ static_cast<u32>(_threads), _memoryLimit });
+      else
+        return new source_filter<compression::lzma_decoder>(source, _bufferSize);
+    }
     
+    template<typename T> data_source* solidDecoder(data_source* source, T*) const { return new source_filter<T>(source, _bufferSize); }
     
-    data_source* apply(data_source* source) const override
+  public:
+    compression_builder(size_t bufferSize, size_t blockSize = 0, size_t threads = 1) : filter_builder(bufferSize), _blockSize(blockSize), _threads(threads), _memoryLimit(SIZE_MAX) { }
+    compression_builder(size_t bufferSize, const byte* payload, size_t threads, size_t memoryLimit) : filter_builder(bufferSize), _blockSize(0), _threads(threads), _memoryLimit(memoryLimit)
     {
-      return new source_filter<compression::deflater_filter>(source, _bufferSize);
+      const box::Payload* header = reinterpret_cast<const box::Payload*>(payload);
+      
+      /* archives without block mode have no payload at all */
+      if (header->length >= sizeof(box::Payload) + sizeof(box::length_t))
+        _blockSize = *reinterpret_cast<const box::length_t*>(payload + sizeof(box::Payload));
     }
     
-    data_source* unapply(data_source* source) const override
+    box::payload_uid identifier() const override { return IDENT; }
+    std::string mnemonic(bool shortMode) const override
     {
-      return new source_filter<compression::inflater_filter>(source, _bufferSize);
+      const char* name = IDENT == identifier::LZMA_FILTER ? "lzma" : "deflate";
+      return shortMode || !isBlocked() ? name : fmt::sprintf("%s:block=%s", name, strings::humanReadableSize(_blockSize, false));
     }
-  };
     
-  class lzma_builder : public filter_builder
-  {
-  private:
-    
-  public:
-    lzma_builder(size_t bufferSize) : filter_builder(bufferSize) { }
-    
-    box::payload_uid identifier() const override { return identifier::LZMA_FILTER; }
-    std::string mnemonic(bool shortMode) const override { return "lzma"; }
-    
-    size_t payloadLength() const override { return 0; }
-    memory_buffer payload() const override { return memory_buffer(0); }
+    size_t payloadLength() const override { return isBlocked() ? sizeof(box::length_t) : 0; }
+    memory_buffer payload() const override
+    {
+      memory_buffer buffer(payloadLength());
+      if (isBlocked())
+        buffer.write((box::length_t)_blockSize);
+      return buffer;
+    }
     
     data_source* apply(data_source* source) const override
     {
-      return new source_filter<compression::lzma_encoder>(source, _bufferSize);
+      if (isBlocked())
+        return new compression::block_encoder<E>(source, _bufferSize, _blockSize);
+      else
+        return new source_filter<E>(source, _bufferSize);
     }
     
     data_source* unapply(data_source* source) const override
     {
-      return new source_filter<compression::lzma_decoder>(source, _bufferSize);
+      if (isBlocked())
+        return new compression::block_decoder<D>(source, _bufferSize, _threads);
+      else
+        return solidDecoder(source, static_cast<D*>(nullptr));
+    }
+    
+    /* blocks which end before offset are skipped without being decoded, a seekable source
+       spans exactly the stream data so its block index can be used to skip them without reading */
+    data_source* unapplyFrom(data_source* source, size_t& offset) const override
+    {
+      if (!isBlocked())
+        return unapply(source);
+      
+      seekable_data_source* seekable = dynamic_cast<seekable_data_source*>(source);
+      data_source* decoder = seekable ? new compression::block_decoder<D>(seekable, _bufferSize, _threads, offset) : new compression::block_decoder<D>(source, _bufferSize, _threads, offset);
+      offset = 0;
+      return decoder;
     }
+    
+    bool isBlocked() const { return _blockSize > 0; }
+    size_t blockSize() const { return _blockSize; }
+    
+    /* number of threads used to decode, memory limit is honored only by multithreaded lzma decoder */
+    void setThreads(size_t threads) { _threads = threads; }
+    void setMemoryLimit(size_t memoryLimit) { _memoryLimit = memoryLimit; }
   };
+  
+  using deflate_builder = compression_builder<compression::deflater_filter, compression::inflater_filter, identifier::DEFLATE_FILTER>;
+  using lzma_builder = compression_builder<compression::lzma_encoder, compression::lzma_decoder, identifier::LZMA_FILTER>;
     
   class xdelta3_builder : public filter_builder
   {
   private:
     seekable_data_source* _source;
     
+    /* decoded source shared through the archive cache, handed over to the decoder when it's unapplied */
+    mutable decoded_source_cache::source_ref _sourceRef;
+    
     box::DigestInfo _sourceDigest;
     
     size_t _xdeltaWindowSize;
     size_t _sourceBlockSize;
     
+    const ArchiveEntry* findSource(const archive_environment& env) const;
+    
   public:
     xdelta3_builder(size_t bufferSize, seekable_data_source* source, size_t xdeltaWindowSize, size_t sourceBlockSize) : filter_builder(bufferSize), _source(source), _xdeltaWindowSize(xdeltaWindowSize), _sourceBlockSize(sourceBlockSize)
     { 
@@ -352,6 +446,8 @@ namespace builders
     
     void setup(const archive_environment& env) override;
     void unsetup(const archive_environment& env) override;
+    bool hasExternalDependencies() const override { return true; }
+    const box::DigestInfo* sourceDigest() const override { return &_sourceDigest; }
     
     box::payload_uid identifier() const override { return identifier::XDELTA3_FILTER; }
     std::string mnemonic(bool shortMode) const override { return shortMode ? "xdelta3" : fmt::sprintf("xdelta3:source_size=%lu,source_crc32=%08X", _sourceDigest.size, _sourceDigest.crc32); }
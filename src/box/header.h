@@ -19,7 +19,9 @@ namespace box
 
   static constexpr index_t INVALID_INDEX = -1;
 
-  static constexpr version_t CURRENT_VERSION = 0x00000001;
+  /* version 2 added original to entry records, version 1 archives are read with shorter records */
+  static constexpr version_t CURRENT_VERSION = 0x00000002;
+  static constexpr version_t FIRST_VERSION = 0x00000001;
 
   enum class Section : u32
   {
@@ -33,6 +35,9 @@ namespace box
     STREAM_DATA,
     FILE_NAME_TABLE,
     GROUP_TABLE,
+    SEEK_TABLE,
+    NAME_INDEX,
+    DIGEST_INDEX,
 
     FIRST_FREE_SECTION_IDENT = 1U << 31
   };
@@ -44,8 +49,8 @@ namespace box
 
   enum class StreamFlag : u64
   {
-    SEEKABLE,
-    HAS_CHECKSUM
+    SEEKABLE = 0x01LLU,
+    HAS_CHECKSUM = 0x02LLU
   };
 
   STRUCT_PACKING_PUSH
@@ -116,9 +121,12 @@ namespace box
     timestamp_t timestamp;
     offset_t entryNameOffset;
     
+    /* entry with identical content whose stream data is shared, INVALID_INDEX if entry has its own */
+    index_t original;
+    
     Entry() :
       filteredSize(0), digest(), timestamp(0),
-      stream(INVALID_INDEX), indexInStream(INVALID_INDEX) { }
+      stream(INVALID_INDEX), indexInStream(INVALID_INDEX), original(INVALID_INDEX) { }
   } PACKED_ATTRIBUTE;
   
   struct Stream
@@ -134,6 +142,43 @@ namespace box
     
   } PACKED_ATTRIBUTE;
   
+  /* point of a stream from which filtered data can be decoded independently from what precedes it */
+  struct SeekPoint
+  {
+    index_t stream;
+    index_t indexInStream; /* first entry starting after the point */
+    offset_t offset; /* offset of the point in stream data */
+    length_t filteredOffset; /* amount of filtered entry data in the stream before the point */
+  } PACKED_ATTRIBUTE;
+  
+  /* slot of the name index, an open addressing table with linear probing whose size is a power of two,
+     empty slots have entry set to INVALID_INDEX */
+  struct NameIndexSlot
+  {
+    u64 hash;
+    index_t entry;
+  } PACKED_ATTRIBUTE;
+  
+  /* record of the digest index, which stores all records sorted by crc32 followed by all records sorted by sha1 */
+  struct DigestIndexRecord
+  {
+    hash::crc32_t crc32;
+    hash::sha1_t sha1;
+    index_t entry;
+  } PACKED_ATTRIBUTE;
+  
+  /* 64 bit FNV-1a of an entry name, it's stored in the name index so it must never change */
+  inline u64 nameHash(const char* name, size_t length)
+  {
+    u64 hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i)
+    {
+      hash ^= static_cast<u8>(name[i]);
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+  
   struct Payload
   {
     payload_uid identifier;
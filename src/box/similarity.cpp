@@ -0,0 +1,194 @@
+#include "similarity.h"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+
+using namespace similarity;
+
+namespace
+{
+  /* random values for each byte of the gear rolling hash, generated with splitmix64 so they're always the same */
+  std::array<u64, 256> gearTable()
+  {
+    std::array<u64, 256> table;
+    u64 state = 0x9E3779B97F4A7C15ULL;
+
+    for (u64& value : table)
+    {
+      u64 z = (state += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      value = z ^ (z >> 31);
+    }
+
+    return table;
+  }
+
+  const std::array<u64, 256> gear = gearTable();
+
+  u64 mix(u64 value)
+  {
+    value = (value ^ (value >> 33)) * 0xFF51AFD7ED558CCDULL;
+    value = (value ^ (value >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    return value ^ (value >> 33);
+  }
+
+  size_t root(std::vector<size_t>& parents, size_t i)
+  {
+    while (parents[i] != i)
+      i = parents[i] = parents[parents[i]];
+    return i;
+  }
+}
+
+sample sample::of(const byte* data, size_t length, size_t averageChunk)
+{
+  assert(averageChunk > 0 && (averageChunk & (averageChunk - 1)) == 0);
+
+  sample result;
+  result._length = length;
+  result._hashes.reserve(length / averageChunk + 1);
+
+  /* gear hash depends only on last 64 bytes, high bits are used since they're mixed the most */
+  size_t bits = 0;
+  while ((size_t(1) << bits) < averageChunk)
+    ++bits;
+
+  const u64 mask = bits > 0 ? static_cast<u64>(averageChunk - 1) << (64 - bits) : 0;
+  const size_t minChunk = averageChunk / 4;
+
+  u64 rolling = 0;
+  u64 chunk = 14695981039346656037ULL;
+  size_t chunkLength = 0;
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    rolling = (rolling << 1) + gear[data[i]];
+    chunk = (chunk ^ data[i]) * 1099511628211ULL;
+    ++chunkLength;
+
+    if (chunkLength >= minChunk && (rolling & mask) == 0)
+    {
+      result._hashes.push_back(chunk);
+      chunk = 14695981039346656037ULL;
+      chunkLength = 0;
+    }
+  }
+
+  if (chunkLength > 0)
+    result._hashes.push_back(chunk);
+
+  std::sort(result._hashes.begin(), result._hashes.end());
+  result._hashes.erase(std::unique(result._hashes.begin(), result._hashes.end()), result._hashes.end());
+
+  return result;
+}
+
+size_t sample::averageChunkFor(size_t maxLength, size_t chunks)
+{
+  size_t average = 64;
+  while (average < KB64 && average * chunks < maxLength)
+    average <<= 1;
+  return average;
+}
+
+float sample::resemblance(const sample& other) const
+{
+  if (_hashes.empty() && other._hashes.empty())
+    return 1.0f;
+
+  size_t shared = 0;
+  for (auto a = _hashes.begin(), b = other._hashes.begin(); a != _hashes.end() && b != other._hashes.end(); )
+  {
+    if (*a < *b)
+      ++a;
+    else if (*b < *a)
+      ++b;
+    else
+    {
+      ++shared;
+      ++a;
+      ++b;
+    }
+  }
+
+  return shared / static_cast<float>(_hashes.size() + other._hashes.size() - shared);
+}
+
+signature signature::of(const sample& sample, size_t count)
+{
+  signature result;
+  result._mins.resize(count, std::numeric_limits<u64>::max());
+
+  /* each slot is the minimum of a different permutation of the hashes, derived by mixing them with a seed */
+  for (u64 hash : sample.hashes())
+    for (size_t i = 0; i < count; ++i)
+      result._mins[i] = std::min(result._mins[i], mix(hash ^ gear[i & 0xFF] ^ (i >> 8)));
+
+  return result;
+}
+
+float signature::resemblance(const signature& other) const
+{
+  assert(_mins.size() == other._mins.size());
+
+  if (_mins.empty())
+    return 1.0f;
+
+  size_t equal = 0;
+  for (size_t i = 0; i < _mins.size(); ++i)
+    equal += _mins[i] == other._mins[i] ? 1 : 0;
+
+  return equal / static_cast<float>(_mins.size());
+}
+
+std::vector<std::vector<size_t>> similarity::cluster(const std::vector<signature>& signatures, float threshold, size_t bands)
+{
+  std::vector<size_t> parents(signatures.size());
+  std::iota(parents.begin(), parents.end(), 0);
+
+  if (!signatures.empty())
+  {
+    const size_t count = signatures.front().mins().size();
+    bands = std::max(size_t(1), std::min(bands, count));
+    const size_t rows = count / bands;
+
+    for (size_t band = 0; band < bands; ++band)
+    {
+      std::unordered_map<u64, size_t> buckets;
+
+      for (size_t i = 0; i < signatures.size(); ++i)
+      {
+        u64 key = band;
+        for (size_t row = band * rows; row < (band + 1) * rows; ++row)
+          key = mix(key ^ signatures[i].mins()[row]);
+
+        auto it = buckets.find(key);
+
+        if (it == buckets.end())
+          buckets.emplace(key, i);
+        else if (root(parents, i) != root(parents, it->second) && signatures[i].resemblance(signatures[it->second]) >= threshold)
+          parents[root(parents, i)] = root(parents, it->second);
+      }
+    }
+  }
+
+  /* clusters are ordered by their first member and members are in order */
+  std::vector<std::vector<size_t>> clusters;
+  std::unordered_map<size_t, size_t> indices;
+
+  for (size_t i = 0; i < signatures.size(); ++i)
+  {
+    auto it = indices.emplace(root(parents, i), clusters.size());
+
+    if (it.second)
+      clusters.emplace_back();
+
+    clusters[it.first->second].push_back(i);
+  }
+
+  return clusters;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "tbx/base/common.h"
+
+#include <vector>
+
+namespace similarity
+{
+  /* hashes of the content defined chunks of some data, chunk boundaries are placed where a rolling hash over
+     the last bytes matches a mask so they're found again after insertions or removals in similar data */
+  class sample
+  {
+  private:
+    std::vector<u64> _hashes;
+    size_t _length;
+
+  public:
+    sample() : _length(0) { }
+
+    /* average chunk length must be a power of two and the same for all samples which are compared */
+    static sample of(const byte* data, size_t length, size_t averageChunk);
+
+    /* average chunk length which gives about chunks samples for the largest of the data */
+    static size_t averageChunkFor(size_t maxLength, size_t chunks = 1024);
+
+    /* estimate in [0, 1] of the fraction of data shared by both, as the jaccard index of the chunk sets */
+    float resemblance(const sample& other) const;
+
+    const std::vector<u64>& hashes() const { return _hashes; }
+    size_t length() const { return _length; }
+  };
+
+  /* minhash of the chunks of a sample, a fixed size sketch whose agreement with another one estimates the
+     resemblance of the samples without comparing them, so comparing doesn't depend on data length */
+  class signature
+  {
+  private:
+    std::vector<u64> _mins;
+
+  public:
+    static signature of(const sample& sample, size_t count = 128);
+
+    float resemblance(const signature& other) const;
+
+    const std::vector<u64>& mins() const { return _mins; }
+  };
+
+  /* groups of similar signatures, candidates are found through locality sensitive hashing so that the
+     work is linear in the amount of signatures: each band of rows is hashed into buckets and members
+     of a bucket are joined to the first one if their estimated resemblance is at least threshold */
+  std::vector<std::vector<size_t>> cluster(const std::vector<signature>& signatures, float threshold, size_t bands = 32);
+}
@@ -0,0 +1,214 @@
+#include "source_cache.h"
+
+#include "tbx/base/path.h"
+#include "tbx/base/exceptions.h"
+#include "tbx/streams/memory_buffer.h"
+
+/* decoded entry moved to a temporary file which is removed when the source is released */
+class spilled_source : public seekable_data_source
+{
+private:
+  file_handle _file;
+  size_t _length;
+  roff_t _position;
+
+public:
+  spilled_source(const memory_buffer& data) : _file(file_handle::temporary()), _length(data.size()), _position(0)
+  {
+    if (!_file || _file.write(data.raw(), 1, data.size()) != data.size())
+      throw exceptions::error_opening_file(path("temporary source cache file"));
+  }
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (_position >= _length)
+      return END_OF_STREAM;
+
+    _file.seek(_position, SEEK_SET);
+    size_t effective = _file.read(dest, 1, std::min(amount, static_cast<size_t>(_length - _position)));
+    _position += effective;
+    return effective;
+  }
+
+  void seek(roff_t position) override { _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _length; }
+};
+
+decoded_source_cache::source_ref decoded_source_cache::acquire(const box::DigestInfo& digest, const decoder& decode)
+{
+  std::lock_guard<std::recursive_mutex> guard(_lock);
+
+  auto it = _items.find(digest);
+
+  if (it != _items.end())
+  {
+    TRACE_A("%p: decoded_source_cache::acquire() hit for source of %lu bytes (crc32: %08X)", this, digest.size, digest.crc32);
+
+    _lru.splice(_lru.end(), _lru, it->second.lru);
+    it->second.source->rewind();
+    return it->second.source;
+  }
+
+  memory_buffer* buffer = new memory_buffer(digest.size);
+  source_ref source(buffer);
+  decode(*buffer);
+  buffer->rewind();
+  ++_decodes;
+
+  TRACE_A("%p: decoded_source_cache::acquire() decoded source of %lu bytes (crc32: %08X)", this, digest.size, digest.crc32);
+
+  /* decoder could have acquired the same digest while running */
+  it = _items.find(digest);
+  if (it != _items.end())
+    return it->second.source;
+
+  _lru.push_back(digest);
+  _items.emplace(std::make_pair(digest, item{ source, buffer->size(), false, std::prev(_lru.end()) }));
+  _inMemory += buffer->size();
+
+  evict();
+
+  return source;
+}
+
+void decoded_source_cache::evict()
+{
+  for (auto lit = _lru.begin(); lit != _lru.end() && _inMemory > _budget; )
+  {
+    auto it = _items.find(*lit);
+    item& current = it->second;
+
+    /* sources still referenced by a filter are kept */
+    if (current.spilled || current.source.use_count() > 1)
+    {
+      ++lit;
+      continue;
+    }
+
+    _inMemory -= current.size;
+
+    if (_spill)
+    {
+      TRACE_A("%p: decoded_source_cache::evict() spilled source of %lu bytes to temporary file", this, current.size);
+
+      current.source = source_ref(new spilled_source(*static_cast<memory_buffer*>(current.source.get())));
+      current.spilled = true;
+      ++lit;
+    }
+    else
+    {
+      TRACE_A("%p: decoded_source_cache::evict() dropped source of %lu bytes", this, current.size);
+
+      _items.erase(it);
+      lit = _lru.erase(lit);
+    }
+  }
+}
+
+void decoded_source_cache::setBudget(size_t budget, bool spill)
+{
+  std::lock_guard<std::recursive_mutex> guard(_lock);
+  _budget = budget;
+  _spill = spill;
+  evict();
+}
+
+void decoded_source_cache::clear()
+{
+  std::lock_guard<std::recursive_mutex> guard(_lock);
+  _items.clear();
+  _lru.clear();
+  _inMemory = 0;
+}
+
+paged_decoded_source::paged_decoded_source(size_t length, size_t pageSize, size_t maxPages, const opener& open) :
+  _open(open), _length(length), _pageSize(pageSize), _maxPages(std::max(maxPages, size_t(1))), _decoded(0), _position(0), _restarts(0)
+{
+  assert(pageSize > 0);
+}
+
+const byte* paged_decoded_source::fetch(size_t index)
+{
+  auto it = _pages.find(index);
+
+  if (it != _pages.end())
+  {
+    _lru.splice(_lru.end(), _lru, it->second.lru);
+    return it->second.data.get();
+  }
+
+  /* page has already been decoded and evicted, decoding starts again */
+  if (!_decoder || index * _pageSize < _decoded)
+  {
+    TRACE_A("%p: paged_decoded_source::fetch() decoding from beginning to reach page %lu", this, index);
+
+    if (_decoder)
+      ++_restarts;
+
+    _decoder = _open();
+    _decoded = 0;
+  }
+
+  const byte* result = nullptr;
+
+  /* pages which are passed are kept too since they're likely to be requested next */
+  while (!result)
+  {
+    const size_t current = _decoded / _pageSize;
+    const size_t length = std::min(_pageSize, static_cast<size_t>(_length - _decoded));
+    std::unique_ptr<byte[]> data(new byte[_pageSize]);
+
+    for (size_t done = 0; done < length; )
+    {
+      size_t effective = _decoder->read(data.get() + done, length - done);
+
+      if (effective == END_OF_STREAM)
+        throw exceptions::unserialization_exception("source entry ended before its size while decoding it");
+
+      done += effective;
+    }
+
+    _decoded += length;
+
+    /* pages kept from a previous decoding are still valid */
+    if (_pages.find(current) != _pages.end())
+      continue;
+
+    if (_pages.size() == _maxPages)
+    {
+      _pages.erase(_lru.front());
+      _lru.pop_front();
+    }
+
+    _lru.push_back(current);
+    auto inserted = _pages.emplace(std::make_pair(current, page{ std::move(data), std::prev(_lru.end()) }));
+
+    if (current == index)
+      result = inserted.first->second.data.get();
+  }
+
+  return result;
+}
+
+size_t paged_decoded_source::read(byte* dest, size_t amount)
+{
+  if (_position >= _length)
+    return END_OF_STREAM;
+
+  amount = std::min(amount, static_cast<size_t>(_length - _position));
+
+  for (size_t done = 0; done < amount; )
+  {
+    const size_t index = _position / _pageSize;
+    const size_t offset = _position % _pageSize;
+    const size_t effective = std::min(amount - done, _pageSize - offset);
+
+    std::memcpy(dest + done, fetch(index) + offset, effective);
+
+    done += effective;
+    _position += effective;
+  }
+
+  return amount;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/streams/data_source.h"
+
+#include "header.h"
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+class memory_buffer;
+
+/* decoded entries shared between filters which need them as source (eg. xdelta3 base entries), each entry is decoded
+   at most once while it's cached. Sources are refcounted so entries in use are never evicted, unused ones are evicted
+   in LRU order when memory exceeds budget and are either dropped or moved to a temporary file if spilling is enabled */
+class decoded_source_cache
+{
+public:
+  using source_ref = std::shared_ptr<seekable_data_source>;
+  using decoder = std::function<void(memory_buffer& sink)>;
+
+private:
+  struct item
+  {
+    source_ref source;
+    size_t size;
+    bool spilled;
+    std::list<box::DigestInfo>::iterator lru;
+  };
+
+  size_t _budget;
+  bool _spill;
+
+  std::unordered_map<box::DigestInfo, item, box::DigestInfo::hash> _items;
+  std::list<box::DigestInfo> _lru;
+  size_t _inMemory;
+  size_t _decodes;
+
+  /* a source can be decoded while another one is being acquired when base entries depend on other ones */
+  mutable std::recursive_mutex _lock;
+
+  void evict();
+
+public:
+  decoded_source_cache(size_t budget, bool spill) : _budget(budget), _spill(spill), _inMemory(0), _decodes(0) { }
+
+  decoded_source_cache(const decoded_source_cache&) = delete;
+  decoded_source_cache& operator=(const decoded_source_cache&) = delete;
+
+  /* cached source for digest, decoded into memory with the decoder if it's not cached */
+  source_ref acquire(const box::DigestInfo& digest, const decoder& decode);
+
+  void setBudget(size_t budget, bool spill);
+  void clear();
+
+  size_t inMemory() const { std::lock_guard<std::recursive_mutex> guard(_lock); return _inMemory; }
+  size_t count() const { std::lock_guard<std::recursive_mutex> guard(_lock); return _items.size(); }
+  size_t decodes() const { std::lock_guard<std::recursive_mutex> guard(_lock); return _decodes; }
+};
+
+/* seekable view of an entry which is decoded sequentially on demand into fixed size pages, only a bounded
+   amount of pages is kept in LRU order so that memory doesn't depend on entry size, reading before the
+   oldest page kept restarts decoding from the beginning with a fresh decoder */
+class paged_decoded_source : public seekable_data_source
+{
+public:
+  using opener = std::function<std::unique_ptr<data_source>()>;
+
+private:
+  struct page
+  {
+    std::unique_ptr<byte[]> data;
+    std::list<size_t>::iterator lru;
+  };
+
+  opener _open;
+  std::unique_ptr<data_source> _decoder;
+
+  const size_t _length;
+  const size_t _pageSize;
+  const size_t _maxPages;
+
+  std::unordered_map<size_t, page> _pages;
+  std::list<size_t> _lru;
+
+  roff_t _decoded;
+  roff_t _position;
+  size_t _restarts;
+
+  const byte* fetch(size_t index);
+
+public:
+  paged_decoded_source(size_t length, size_t pageSize, size_t maxPages, const opener& open);
+
+  /* reads amount fully unless past the end since xdelta3 expects whole blocks */
+  size_t read(byte* dest, size_t amount) override;
+
+  void seek(roff_t position) override { _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _length; }
+
+  size_t restarts() const { return _restarts; }
+  size_t sizeInMemory() const { return _pages.size() * _pageSize; }
+};
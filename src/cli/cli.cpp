@@ -539,7 +539,7 @@ void cli::listArchiveContent(const ListArchiveOptions& options, const Archive& a
     }
     
     row.push_back(fmt::sprintf("%lu:%lu", binary.stream, binary.indexInStream));
-    row.push_back(entry.name());
+    row.push_back(std::string(entry.name()));
     
     table.addRow(row);
   }
@@ -609,6 +609,7 @@ int mainzzz(int argc, const char* argv[])
 }
 
 #include "box/archive_builder.h"
+#include "tbx/base/concurrency.h"
 int main(int argc, const char* argv[])
 {
   //auto session = Catch::Session();
@@ -629,10 +630,10 @@ int main(int argc, const char* argv[])
     std::cout << "Found " << sources.size() << " files to archive." << std::endl;
 
     archive = builder.buildSingleStreamBaseWithDeltasArchive(sources, 0);// builder.buildSingleStreamSolidArchive(sources);
-    memory_buffer sink;
+    file_data_writer sink(output);
     archive.options().bufferSize = MB1;
+    archive.options().threads = concurrency::thread_pool::hardwareConcurrency();
     archive.write(sink);
-    sink.serialize(file_handle(output, file_mode::WRITING));
   }
   else if (false)
   {    
@@ -640,9 +641,8 @@ int main(int argc, const char* argv[])
     archive.options().bufferSize = MB256;
     archive.read(source);
 
-    memory_buffer sink;
+    file_data_writer sink("output2.box");
     archive.write(sink);
-    sink.serialize(file_handle("output2.box", file_mode::WRITING));
   }
 
   cli::printArchiveInformation(output, archive);
@@ -680,10 +680,9 @@ int disabled(int argc, const char* argv[])
   std::cout << "Found " << sources.size() << " files to archive." << std::endl;
   
   Archive archive = builder.buildSingleStreamBaseWithDeltasArchive(sources, 0);
-  memory_buffer sink;
+  file_data_writer sink("output.box");
   archive.options().bufferSize = MB32;
   archive.write(sink);
-  sink.serialize(file_handle("output.box", file_mode::WRITING));
   
   cli::printArchiveInformation("output.box", archive);
   
@@ -21,6 +21,7 @@ archive_handle* boxOpenArchive(const char* path)
   handle->path = path;
   handle->handle = (archive_handle*)handle;
   handle->archive = Archive();
+  handle->archive.options().lazyEntries = true;
 
   auto source = file_data_source(path);
   handle->archive.read(source);
@@ -61,7 +62,7 @@ void boxFillEntryInfo(archive_handle* handle, size_t entryIndex, EntryInfo* info
   {
     const auto& entry = archive.entries()[entryIndex];
     
-    info->name = entry.name().c_str();
+    info->name = entry.name().data();
 
     info->size = entry.binary().digest.size;
     info->filteredSize = entry.binary().filteredSize;
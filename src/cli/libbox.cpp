@@ -20,6 +20,7 @@ archive_handle* boxOpenArchive(const char* path)
   handle->path = path;
   handle->handle = (archive_handle*)handle;
   handle->archive = Archive();
+  handle->archive.options().lazyEntries = true;
 
   auto source = file_data_source(path);
   handle->archive.read(source);
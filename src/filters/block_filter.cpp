@@ -0,0 +1,218 @@
+#include "block_filter.h"
+
+#include "tbx/base/exceptions.h"
+
+#include "lzma_filter.h"
+#include "deflate_filter.h"
+
+using namespace compression;
+
+template<typename F>
+void compression::code(memory_buffer& input, memory_buffer& output, size_t bufferSize)
+{
+  input.rewind();
+  source_filter<F> filter(&input, bufferSize);
+  passthrough_pipe pipe(&filter, &output, bufferSize);
+  pipe.process();
+}
+
+#pragma mark block_encoder
+template<typename F>
+block_encoder<F>::block_encoder(data_source* source, size_t bufferSize, size_t blockSize) :
+  _source(source), _bufferSize(bufferSize), _blockSize(blockSize), _frame(0), _offset(0), _decodedOffset(0), _ended(false)
+{
+  assert(blockSize > 0 && blockSize <= std::numeric_limits<u32>::max());
+}
+
+template<typename F>
+void block_encoder<F>::fetchBlock()
+{
+  memory_buffer block(_blockSize);
+  block.advance(_source->readFully(block.tail(), _blockSize));
+
+  memory_buffer compressed(_bufferSize);
+  if (!block.empty())
+    code<F>(block, compressed, _bufferSize);
+
+  _frame = memory_buffer(sizeof(block_header)*2 + compressed.size());
+
+  if (!block.empty())
+  {
+    _frame.write(block_header{ static_cast<u32>(block.size()), static_cast<u32>(compressed.size()) });
+    _frame.write(compressed.raw(), 1, compressed.size());
+
+    _index.push_back({ _offset, _decodedOffset });
+    _offset += sizeof(block_header) + compressed.size();
+    _decodedOffset += block.size();
+
+    TRACE("%p: block_encoder::fetchBlock() compressed %lu bytes into %lu bytes", this, block.size(), compressed.size());
+  }
+
+  /* a short block means that source is finished */
+  if (block.size() < _blockSize)
+  {
+    _frame.write(block_header{ 0, 0 });
+
+    for (const block_index_entry& entry : _index)
+      _frame.write(entry);
+    _frame.write(static_cast<u64>(_index.size()));
+
+    _ended = true;
+  }
+
+  _frame.rewind();
+}
+
+template<typename F>
+size_t block_encoder<F>::read(byte* dest, size_t amount)
+{
+  if (_frame.eob())
+  {
+    if (_ended)
+      return END_OF_STREAM;
+
+    fetchBlock();
+  }
+
+  return _frame.read(dest, 1, amount);
+}
+
+#pragma mark block_decoder
+template<typename F>
+block_decoder<F>::block_decoder(data_source* source, size_t bufferSize, size_t threads, size_t offset) :
+  _source(source), _seekable(nullptr), _bufferSize(bufferSize), _threads(std::max(threads, size_t(1))), _offset(offset), _current(0), _sourceEnded(false)
+{
+  if (_threads > 1)
+    _pool.reset(new concurrency::thread_pool(_threads));
+}
+
+template<typename F>
+block_decoder<F>::block_decoder(seekable_data_source* source, size_t bufferSize, size_t threads, size_t offset) :
+  block_decoder(static_cast<data_source*>(source), bufferSize, threads, offset)
+{
+  _seekable = source;
+}
+
+template<typename F>
+void block_decoder<F>::seekToOffset()
+{
+  const size_t size = _seekable->size();
+  u64 count;
+
+  if (size < sizeof(u64))
+    throw exceptions::unserialization_exception("block stream is truncated, missing block index");
+
+  _seekable->seek(size - sizeof(u64));
+  _seekable->readFully(reinterpret_cast<byte*>(&count), sizeof(u64));
+
+  if (count > (size - sizeof(u64)) / sizeof(block_index_entry))
+    throw exceptions::unserialization_exception("block index is larger than block stream");
+
+  std::vector<block_index_entry> index(count);
+  _seekable->seek(size - sizeof(u64) - count * sizeof(block_index_entry));
+  _seekable->readFully(reinterpret_cast<byte*>(index.data()), count * sizeof(block_index_entry));
+
+  /* last block starting at or before offset contains it */
+  auto it = std::upper_bound(index.begin(), index.end(), _offset, [] (size_t offset, const block_index_entry& entry) {
+    return offset < entry.decodedOffset;
+  });
+
+  if (it == index.begin())
+  {
+    _seekable->rewind();
+    return;
+  }
+
+  const block_index_entry& entry = *std::prev(it);
+
+  if (entry.offset >= size)
+    throw exceptions::unserialization_exception("block index refers to a block outside of block stream");
+
+  TRACE("%p: block_decoder::seekToOffset() seeking to block at %lu for offset %lu", this, entry.offset, _offset);
+
+  _seekable->seek(entry.offset);
+  _offset -= entry.decodedOffset;
+}
+
+template<typename F>
+void block_decoder<F>::schedule()
+{
+  while (!_sourceEnded && _pending.size() < _threads)
+  {
+    block_header header;
+
+    if (_source->readFully(reinterpret_cast<byte*>(&header), sizeof(block_header)) != sizeof(block_header))
+      throw exceptions::unserialization_exception("block stream is truncated, missing block header");
+
+    if (header.length == 0)
+    {
+      _sourceEnded = true;
+      break;
+    }
+
+    memory_buffer compressed(header.compressedLength);
+    compressed.advance(_source->readFully(compressed.tail(), header.compressedLength));
+
+    if (compressed.size() != header.compressedLength)
+      throw exceptions::unserialization_exception("block stream is truncated, missing block data");
+
+    /* block is entirely before requested offset so there's no need to decode it */
+    if (_offset >= header.length)
+    {
+      TRACE("%p: block_decoder::schedule() skipped block of %lu bytes", this, header.length);
+      _offset -= header.length;
+      continue;
+    }
+
+    const size_t skip = _offset;
+    const size_t bufferSize = _bufferSize;
+    _offset = 0;
+
+    auto task = [input = std::move(compressed), skip, bufferSize, header] () mutable {
+      memory_buffer output(header.length);
+      code<F>(input, output, bufferSize);
+
+      if (output.size() != header.length)
+        throw exceptions::unserialization_exception("decoded block size doesn't match its header");
+
+      output.seek(skip);
+      return output;
+    };
+
+    /* without a pool block is decoded lazily on the calling thread when needed */
+    if (_pool)
+      _pending.push_back(_pool->submit(std::move(task)));
+    else
+      _pending.push_back(std::async(std::launch::deferred, std::move(task)));
+  }
+}
+
+template<typename F>
+size_t block_decoder<F>::read(byte* dest, size_t amount)
+{
+  /* index is only worth reading if some blocks can be skipped */
+  if (_seekable && _offset > 0)
+    seekToOffset();
+  _seekable = nullptr;
+
+  while (_current.eob())
+  {
+    schedule();
+
+    if (_pending.empty())
+      return END_OF_STREAM;
+
+    _current = _pending.front().get();
+    _pending.pop_front();
+
+    /* next blocks are queued while this one is consumed */
+    schedule();
+  }
+
+  return _current.read(dest, 1, amount);
+}
+
+template class compression::block_encoder<lzma_encoder>;
+template class compression::block_decoder<lzma_decoder>;
+template class compression::block_encoder<deflater_filter>;
+template class compression::block_decoder<inflater_filter>;
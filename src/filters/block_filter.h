@@ -0,0 +1,87 @@
+#pragma once
+
+#include "tbx/base/concurrency.h"
+#include "tbx/streams/data_source.h"
+#include "tbx/streams/data_pipe.h"
+#include "tbx/streams/data_filter.h"
+
+#include <deque>
+#include <future>
+#include <memory>
+
+namespace compression
+{
+  /* header which precedes each block, a block with both lengths zero terminates the stream
+     so that decoding stops without requiring the source to end */
+  struct block_header
+  {
+    u32 length;
+    u32 compressedLength;
+  };
+
+  /* blocks are followed by an index with an entry per block and by the amount of entries, so that a decoder
+     over a seekable source can start from the block containing an offset without reading earlier ones */
+  struct block_index_entry
+  {
+    u64 offset;
+    u64 decodedOffset;
+  };
+
+  /* cuts source into blocks of fixed size which are compressed independently by F,
+     each block is written preceded by its header and the index is written after the last one */
+  template<typename F>
+  class block_encoder : public data_source
+  {
+  private:
+    data_source* _source;
+    const size_t _bufferSize;
+    const size_t _blockSize;
+
+    memory_buffer _frame;
+    std::vector<block_index_entry> _index;
+    u64 _offset;
+    u64 _decodedOffset;
+    bool _ended;
+
+    void fetchBlock();
+
+  public:
+    block_encoder(data_source* source, size_t bufferSize, size_t blockSize);
+
+    size_t read(byte* dest, size_t amount) override;
+  };
+
+  /* decodes blocks produced by block_encoder, with more than one thread multiple blocks are
+     decoded ahead in parallel while output is still produced in order. Blocks which end before
+     offset are skipped without being decoded, if source is seekable it must span exactly the
+     encoded data and the index is used to seek straight to the first needed block.
+     Pending tasks own their data so they can outlive it. */
+  template<typename F>
+  class block_decoder : public data_source
+  {
+  private:
+    data_source* _source;
+    seekable_data_source* _seekable;
+    const size_t _bufferSize;
+    const size_t _threads;
+    size_t _offset;
+
+    std::unique_ptr<concurrency::thread_pool> _pool;
+    std::deque<std::future<memory_buffer>> _pending;
+
+    memory_buffer _current;
+    bool _sourceEnded;
+
+    void seekToOffset();
+    void schedule();
+
+  public:
+    block_decoder(data_source* source, size_t bufferSize, size_t threads = 1, size_t offset = 0);
+    block_decoder(seekable_data_source* source, size_t bufferSize, size_t threads, size_t offset);
+
+    size_t read(byte* dest, size_t amount) override;
+  };
+
+  /* runs whole data through a filter of type F */
+  template<typename F> void code(memory_buffer& input, memory_buffer& output, size_t bufferSize);
+}
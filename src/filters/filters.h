@@ -1,8 +1,11 @@
 #pragma once
 
 #include "tbx/hash/hash.h"
+#include "tbx/base/concurrency.h"
 #include "tbx/streams/data_filter.h"
 
+#include <array>
+
 namespace filters
 {
   template<typename D>
@@ -31,6 +34,83 @@ namespace filters
   using md5_filter = digest_filter<hash::md5_digester>;
   using sha1_filter = digest_filter<hash::sha1_digester>;
   
+  /* runs each updater on its own thread, data is copied into a ring of chunks
+     which can be reused once every lane has processed them */
+  class digest_lanes
+  {
+  public:
+    using updater_t = std::function<void(const byte*, size_t)>;
+    
+  private:
+    struct chunk
+    {
+      std::vector<byte> data;
+      std::atomic<size_t> pending;
+    };
+    
+    static constexpr size_t RING_SIZE = 8;
+    
+    std::array<chunk, RING_SIZE> _ring;
+    size_t _next;
+    
+    std::vector<std::unique_ptr<concurrency::spsc_queue<chunk*>>> _queues;
+    std::vector<std::thread> _lanes;
+    std::atomic<bool> _abort;
+    
+  public:
+    digest_lanes(const std::vector<updater_t>& updaters) : _next(0), _abort(false)
+    {
+      for (chunk& chunk : _ring)
+        chunk.pending = 0;
+      
+      for (const updater_t& updater : updaters)
+      {
+        _queues.emplace_back(new concurrency::spsc_queue<chunk*>(RING_SIZE + 1));
+        auto* queue = _queues.back().get();
+        
+        _lanes.emplace_back([this, queue, updater] () {
+          chunk* chunk;
+          
+          /* nullptr is used as end marker */
+          while (queue->pop(chunk, _abort) && chunk)
+          {
+            updater(chunk->data.data(), chunk->data.size());
+            chunk->pending.fetch_sub(1, std::memory_order_release);
+          }
+        });
+      }
+    }
+    
+    ~digest_lanes() { join(); }
+    
+    void push(const byte* data, size_t length)
+    {
+      chunk& chunk = _ring[_next];
+      _next = (_next + 1) % RING_SIZE;
+      
+      for (size_t attempt = 0; chunk.pending.load(std::memory_order_acquire) > 0; ++attempt)
+        concurrency::spsc_queue<struct chunk*>::backoff(attempt);
+      
+      chunk.data.assign(data, data + length);
+      chunk.pending.store(_queues.size(), std::memory_order_relaxed);
+      
+      for (auto& queue : _queues)
+        queue->push(&chunk, _abort);
+    }
+    
+    void join()
+    {
+      for (auto& queue : _queues)
+        queue->push(nullptr, _abort);
+      
+      for (std::thread& lane : _lanes)
+        lane.join();
+      
+      _queues.clear();
+      _lanes.clear();
+    }
+  };
+  
   class multiple_digest_filter : public unbuffered_data_filter
   {
   private:
@@ -42,15 +122,42 @@ namespace filters
     bool _md5enabled;
     bool _sha1enabled;
     
+    /* when parallel each digester is updated on its own lane, lanes are joined at end of stream */
+    bool _parallel;
+    std::unique_ptr<digest_lanes> _lanes;
+    
+    size_t enabledCount() const { return _crc32enabled + _md5enabled + _sha1enabled; }
+    
+    void join() { _lanes.reset(); }
+    
   public:
-    multiple_digest_filter(bool crc32 = true, bool md5 = true, bool sha1 = true) :
+    multiple_digest_filter(bool crc32 = true, bool md5 = true, bool sha1 = true, bool parallel = false) :
     _crc32(), _md5(), _sha1(),
-    _crc32enabled(crc32), _md5enabled(md5), _sha1enabled(sha1)
+    _crc32enabled(crc32), _md5enabled(md5), _sha1enabled(sha1),
+    _parallel(parallel && enabledCount() > 1)
     { }
 
     void process(const byte* data, size_t amount, size_t effective) override
     {
-      if (effective != END_OF_STREAM)
+      if (effective == END_OF_STREAM)
+        join();
+      else if (_parallel)
+      {
+        if (effective == 0)
+          return;
+        
+        if (!_lanes)
+        {
+          std::vector<digest_lanes::updater_t> updaters;
+          if (_crc32enabled) updaters.push_back([this] (const byte* data, size_t length) { _crc32.update(data, length); });
+          if (_md5enabled) updaters.push_back([this] (const byte* data, size_t length) { _md5.update(data, length); });
+          if (_sha1enabled) updaters.push_back([this] (const byte* data, size_t length) { _sha1.update(data, length); });
+          _lanes.reset(new digest_lanes(updaters));
+        }
+        
+        _lanes->push(data, effective);
+      }
+      else
       {
         if (_crc32enabled) _crc32.update(data, effective);
         if (_md5enabled) _md5.update(data, effective);
@@ -58,9 +165,9 @@ namespace filters
       }
     }
     
-    hash::crc32_t crc32() { assert(_crc32enabled); return _crc32.get(); }
-    hash::md5_t md5() { assert(_md5enabled); return _md5.get(); }
-    hash::sha1_t sha1() { assert(_sha1enabled); return _sha1.get(); }
+    hash::crc32_t crc32() { assert(_crc32enabled); join(); return _crc32.get(); }
+    hash::md5_t md5() { assert(_md5enabled); join(); return _md5.get(); }
+    hash::sha1_t sha1() { assert(_sha1enabled); join(); return _sha1.get(); }
     
     std::string name() const override { return "multiple_digest"; }
 
@@ -4,6 +4,11 @@
 
 #include "lzma_filter.h"
 
+#include "tbx/base/exceptions.h"
+
+#include <algorithm>
+#include <cstdlib>
+
 template<bool E>
 const char* compression::lzma_filter<E>::printableErrorCode(lzma_ret r)
 {
@@ -33,7 +38,7 @@ void compression::lzma_filter<IS_ENCODER>::init()
   {
     lzma_mt options = {
       .flags = 0,
-      .block_size = 0,
+      .block_size = _options.blockSize,
       .timeout = 0,
       
       .preset = _options.level | (_options.extreme ? LZMA_PRESET_EXTREME : 0),
@@ -44,7 +49,10 @@ void compression::lzma_filter<IS_ENCODER>::init()
     };
 
     options.preset = LZMA_PRESET_DEFAULT;
-    options.threads = lzma_cputhreads() - 2;
+    
+    /* lzma_cputhreads() returns 0 when it can't be determined */
+    const u32 cores = lzma_cputhreads();
+    options.threads = cores > 2 ? cores - 2 : 1;
 
     _r = lzma_stream_encoder_mt(&_stream, &options);
     //lzma_easy_encoder(&_stream, _options.level | (_options.extreme ? LZMA_PRESET_EXTREME : 0), /*LZMA_CHECK_CRC64*/LZMA_CHECK_NONE);
@@ -106,3 +114,224 @@ void compression::lzma_filter<IS_ENCODER>::process()
 
 template class compression::lzma_filter<true>;
 template class compression::lzma_filter<false>;
+
+#pragma mark lzma_mt_decoder
+namespace
+{
+  /* options of the filters of a block are allocated by liblzma while decoding its header and must be released by caller */
+  struct block_filters
+  {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    
+    block_filters() { filters[0].id = LZMA_VLI_UNKNOWN; }
+    ~block_filters()
+    {
+      for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+        free(filters[i].options);
+    }
+  };
+  
+  lzma_ret decodeBlockHeader(const byte* data, lzma_check check, lzma_block& block, block_filters& filters)
+  {
+    block = lzma_block();
+    block.version = 0;
+    block.check = check;
+    block.header_size = lzma_block_header_size_decode(data[0]);
+    block.filters = filters.filters;
+    
+    return lzma_block_header_decode(&block, nullptr, data);
+  }
+}
+
+using namespace compression;
+
+lzma_mt_decoder::lzma_mt_decoder(data_source* source, size_t bufferSize, const options::LZMADecoder& options) :
+  _source(source), _bufferSize(bufferSize), _options({ std::max(options.threads, 1U), options.memoryLimit }), _pendingMemory(0), _parallelism(0),
+  _index(nullptr), _next(0), _current(0), _started(false), _sourceEnded(false), _prefix(0)
+{
+  if (_options.threads > 1)
+    _pool.reset(new concurrency::thread_pool(_options.threads));
+}
+
+lzma_mt_decoder::~lzma_mt_decoder()
+{
+  lzma_index_hash_end(_index, nullptr);
+}
+
+void lzma_mt_decoder::start()
+{
+  _started = true;
+  
+  byte header[LZMA_STREAM_HEADER_SIZE];
+  if (_source->readFully(header, LZMA_STREAM_HEADER_SIZE) != LZMA_STREAM_HEADER_SIZE || lzma_stream_header_decode(&_flags, header) != LZMA_OK)
+    throw exceptions::unserialization_exception("lzma stream has no valid stream header");
+  
+  _index = lzma_index_hash_init(nullptr, nullptr);
+  if (!_index)
+    throw exceptions::not_enough_memory("lzma_mt_decoder");
+  
+  if (!fetchHeader())
+    return;
+  
+  lzma_block block;
+  block_filters filters;
+  
+  if (decodeBlockHeader(_next.raw(), _flags.check, block, filters) != LZMA_OK)
+    throw exceptions::unserialization_exception("lzma block header is invalid");
+  
+  /* without sizes blocks can't be split from the stream so what has been read is prepended to the rest of the source */
+  if (block.compressed_size == LZMA_VLI_UNKNOWN || block.uncompressed_size == LZMA_VLI_UNKNOWN)
+  {
+    TRACE("%p: lzma_mt_decoder::start() block sizes are unknown, decoding on a single thread", this);
+    
+    _prefix = memory_buffer(LZMA_STREAM_HEADER_SIZE + _next.size());
+    _prefix.write(header, 1, LZMA_STREAM_HEADER_SIZE);
+    _prefix.write(_next.raw(), 1, _next.size());
+    _prefix.rewind();
+    
+    _prefixed.reset(new multiple_data_source({ &_prefix, _source }));
+    _fallback.reset(new source_filter<lzma_decoder>(_prefixed.get(), _bufferSize));
+    _parallelism = 1;
+  }
+}
+
+bool lzma_mt_decoder::fetchHeader()
+{
+  if (!_next.empty())
+    return true;
+  
+  byte first;
+  if (_source->readFully(&first, 1) != 1)
+    throw exceptions::unserialization_exception("lzma stream is truncated, missing block header");
+  
+  /* a zero byte in place of a block header starts the index */
+  if (first == 0x00)
+  {
+    finish();
+    return false;
+  }
+  
+  const size_t length = lzma_block_header_size_decode(first);
+  
+  _next = memory_buffer(length);
+  _next.write(&first, 1, 1);
+  _next.advance(_source->readFully(_next.tail(), length - 1));
+  
+  if (_next.size() != length)
+    throw exceptions::unserialization_exception("lzma stream is truncated, missing block header");
+  
+  return true;
+}
+
+void lzma_mt_decoder::finish()
+{
+  /* index must match the blocks which have been decoded and footer must match header, data after footer is left untouched */
+  const size_t length = lzma_index_hash_size(_index);
+  
+  memory_buffer index(length + LZMA_STREAM_HEADER_SIZE);
+  index.write((u8)0x00);
+  index.advance(_source->readFully(index.tail(), index.capacity() - 1));
+  
+  if (index.size() != index.capacity())
+    throw exceptions::unserialization_exception("lzma stream is truncated, missing index");
+  
+  size_t position = 0;
+  lzma_stream_flags footer;
+  
+  if (lzma_index_hash_decode(_index, index.raw(), &position, length) != LZMA_STREAM_END)
+    throw exceptions::unserialization_exception("lzma stream index doesn't match its blocks");
+  
+  if (lzma_stream_footer_decode(&footer, index.raw() + length) != LZMA_OK || lzma_stream_flags_compare(&_flags, &footer) != LZMA_OK || footer.backward_size != length)
+    throw exceptions::unserialization_exception("lzma stream footer is invalid");
+  
+  _sourceEnded = true;
+}
+
+void lzma_mt_decoder::schedule()
+{
+  while (!_sourceEnded && _pending.size() < _options.threads)
+  {
+    if (!fetchHeader())
+      break;
+    
+    lzma_block block;
+    block_filters filters;
+    
+    if (decodeBlockHeader(_next.raw(), _flags.check, block, filters) != LZMA_OK)
+      throw exceptions::unserialization_exception("lzma block header is invalid");
+    
+    if (block.compressed_size == LZMA_VLI_UNKNOWN || block.uncompressed_size == LZMA_VLI_UNKNOWN)
+      throw exceptions::unserialization_exception("lzma block has no sizes after blocks with sizes");
+    
+    const size_t total = lzma_block_total_size(&block);
+    const size_t uncompressed = block.uncompressed_size;
+    const size_t memory = total + uncompressed;
+    
+    /* past memory limit next block waits until the ones being decoded are consumed */
+    if (!_pending.empty() && _pendingMemory + memory > _options.memoryLimit)
+      break;
+    
+    if (lzma_index_hash_append(_index, lzma_block_unpadded_size(&block), uncompressed) != LZMA_OK)
+      throw exceptions::unserialization_exception("lzma stream has too many blocks");
+    
+    memory_buffer input(total);
+    input.write(_next.raw(), 1, _next.size());
+    input.advance(_source->readFully(input.tail(), total - _next.size()));
+    _next = memory_buffer(0);
+    
+    if (input.size() != total)
+      throw exceptions::unserialization_exception("lzma stream is truncated, missing block data");
+    
+    const lzma_check check = _flags.check;
+    
+    auto task = [input = std::move(input), check, uncompressed] () mutable {
+      lzma_block block;
+      block_filters filters;
+      decodeBlockHeader(input.raw(), check, block, filters);
+      
+      memory_buffer output(uncompressed);
+      size_t inPosition = block.header_size, outPosition = 0;
+      
+      if (lzma_block_buffer_decode(&block, nullptr, input.raw(), &inPosition, input.size(), output.raw(), &outPosition, uncompressed) != LZMA_OK || outPosition != uncompressed)
+        throw exceptions::unserialization_exception("lzma block can't be decoded");
+      
+      output.advance(outPosition);
+      return output;
+    };
+    
+    /* without a pool block is decoded lazily on the calling thread when needed */
+    if (_pool)
+      _pending.push_back(std::make_pair(_pool->submit(std::move(task)), memory));
+    else
+      _pending.push_back(std::make_pair(std::async(std::launch::deferred, std::move(task)), memory));
+    
+    _pendingMemory += memory;
+    _parallelism = std::max(_parallelism, _pending.size());
+  }
+}
+
+size_t lzma_mt_decoder::read(byte* dest, size_t amount)
+{
+  if (!_started)
+    start();
+  
+  if (_fallback)
+    return _fallback->read(dest, amount);
+  
+  while (_current.eob())
+  {
+    schedule();
+    
+    if (_pending.empty())
+      return END_OF_STREAM;
+    
+    _current = _pending.front().first.get();
+    _pendingMemory -= _pending.front().second;
+    _pending.pop_front();
+    
+    /* next blocks are queued while this one is consumed */
+    schedule();
+  }
+  
+  return _current.read(dest, 1, amount);
+}
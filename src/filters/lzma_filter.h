@@ -1,17 +1,29 @@
 #pragma once
 
+#include "tbx/base/concurrency.h"
 #include "tbx/streams/data_source.h"
 #include "tbx/streams/data_pipe.h"
 #include "tbx/streams/data_filter.h"
 
 #include "lzma.h"
 
+#include <deque>
+#include <future>
+#include <memory>
+
 namespace options
 {
   struct LZMAEncoder
   {
     u32 level;
     bool extreme;
+    u64 blockSize; /* size of the blocks the stream is split into by the encoder threads, 0 lets liblzma choose it */
+  };
+  
+  struct LZMADecoder
+  {
+    u32 threads; /* amount of blocks of a stream decoded in parallel */
+    u64 memoryLimit; /* past this amount of memory for blocks being decoded they're decoded one at a time */
   };
 }
 
@@ -30,7 +42,7 @@ namespace compression
     
   public:
     lzma_filter(size_t bufferSize, const options::LZMAEncoder& options) : data_filter(bufferSize), _stream(LZMA_STREAM_INIT), _options(options) { }
-    lzma_filter(size_t bufferSize) : lzma_filter(bufferSize, { 9, true}) { }
+    lzma_filter(size_t bufferSize) : lzma_filter(bufferSize, options::LZMAEncoder{ 9, true, 0 }) { }
     
     void init() override;
     void process() override;
@@ -41,5 +53,46 @@ namespace compression
   
   using lzma_encoder = lzma_filter<true>;
   using lzma_decoder = lzma_filter<false>;
+  
+  /* decodes a stream whose block headers store their sizes, as written by the multithreaded encoder, by decoding
+     multiple blocks ahead in parallel while output is still produced in order. Blocks are decoded ahead only while
+     their buffers fit the memory limit. A stream whose first block has no sizes is decoded by a single lzma_decoder. */
+  class lzma_mt_decoder : public data_source
+  {
+  private:
+    data_source* _source;
+    const size_t _bufferSize;
+    const options::LZMADecoder _options;
+    
+    std::unique_ptr<concurrency::thread_pool> _pool;
+    std::deque<std::pair<std::future<memory_buffer>, size_t>> _pending;
+    size_t _pendingMemory;
+    size_t _parallelism;
+    
+    lzma_stream_flags _flags;
+    lzma_index_hash* _index;
+    memory_buffer _next;
+    memory_buffer _current;
+    bool _started;
+    bool _sourceEnded;
+    
+    memory_buffer _prefix;
+    std::unique_ptr<data_source> _prefixed;
+    std::unique_ptr<data_source> _fallback;
+    
+    void start();
+    bool fetchHeader();
+    void finish();
+    void schedule();
+    
+  public:
+    lzma_mt_decoder(data_source* source, size_t bufferSize, const options::LZMADecoder& options);
+    ~lzma_mt_decoder();
+    
+    size_t read(byte* dest, size_t amount) override;
+    
+    /* largest amount of blocks which were being decoded at the same time */
+    size_t parallelism() const { return _parallelism; }
+  };
 
 }
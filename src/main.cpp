@@ -180,12 +180,10 @@ int main(int argc, const char* argv[])
   auto sources = builder.buildSourcesFromFolder(path);
   Archive archive = builder.buildBestSingleStreamDeltaArchive(sources);
 
-  memory_buffer sink;
+  file_data_writer sink(path.append("box-xdelta.box"));
   archive.options().bufferSize = MB32;
   archive.write(sink);
 
-  sink.serialize(file_handle(path.append("box-xdelta.box"), file_mode::WRITING, false));
-
   return 0;
 }
 
@@ -201,10 +199,9 @@ int disabled(int argc, const char * argv[])
   auto sources = builder.buildSourcesFromFolder("/Users/jack/Desktop/XNB To PNG Converter/patapon");
   //Archive archive = builder.buildSingleStreamBaseWithDeltasArchive(sources, 0);
   Archive archive = builder.buildSingleStreamSolidArchive(sources);
-  memory_buffer sink;
+  file_data_writer sink("/Users/jack/Desktop/XNB To PNG Converter/patapon.box");
   archive.options().bufferSize = MB32;
   archive.write(sink);
-  sink.serialize(file_handle("/Users/jack/Desktop/XNB To PNG Converter/patapon.box", file_mode::WRITING));
   
   return 0;
   
@@ -225,18 +222,16 @@ int disabled(int argc, const char * argv[])
   {
     Archive archive = builder.buildSingleStreamBaseWithDeltasArchive(sources, baseIndex);
     //Archive archive = builder.buildBestSingleStreamDeltaArchive(sources);
-    memory_buffer sink;
+    file_data_writer sink("/Volumes/RAMDisk/test/test-lzma+delta.box");
     archive.write(sink);
-    sink.serialize(file_handle("/Volumes/RAMDisk/test/test-lzma+delta.box", file_mode::WRITING));
     
     //builder.extractWholeArchiveIntoFolder("/Volumes/RAMDisk/test/test-lzma+delta.box", "/Volumes/RAMDisk/dest");
   }
   
   {
     Archive archive = builder.buildSingleStreamSolidArchive(sources);
-    memory_buffer sink;
+    file_data_writer sink("/Volumes/RAMDisk/test/test-solid.box");
     archive.write(sink);
-    sink.serialize(file_handle("/Volumes/RAMDisk/test/test-solid.box", file_mode::WRITING));
   }
 
   return 0;
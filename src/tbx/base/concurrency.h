@@ -0,0 +1,179 @@
+#pragma once
+
+#include "common.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace concurrency
+{
+  /* bounded lock-free queue for exactly one producer and one consumer thread,
+     capacity is rounded up to a power of two */
+  template<typename T>
+  class spsc_queue
+  {
+  private:
+    std::vector<T> _data;
+    size_t _mask;
+    
+    /* kept on different cache lines since they're written by different threads */
+    alignas(64) std::atomic<size_t> _head;
+    alignas(64) std::atomic<size_t> _tail;
+    
+  public:
+    spsc_queue(size_t capacity) : _head(0), _tail(0)
+    {
+      size_t size = 1;
+      while (size < capacity)
+        size <<= 1;
+      
+      _data.resize(size);
+      _mask = size - 1;
+    }
+    
+    bool tryPush(const T& value)
+    {
+      size_t tail = _tail.load(std::memory_order_relaxed);
+      
+      if (tail - _head.load(std::memory_order_acquire) == _data.size())
+        return false;
+      
+      _data[tail & _mask] = value;
+      _tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+    
+    bool tryPop(T& value)
+    {
+      size_t head = _head.load(std::memory_order_relaxed);
+      
+      if (head == _tail.load(std::memory_order_acquire))
+        return false;
+      
+      value = std::move(_data[head & _mask]);
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+    
+    /* blocking variants, they give up when abort becomes true */
+    bool push(const T& value, const std::atomic<bool>& abort)
+    {
+      for (size_t attempt = 0; !tryPush(value); ++attempt)
+      {
+        if (abort.load(std::memory_order_relaxed))
+          return false;
+        backoff(attempt);
+      }
+      return true;
+    }
+    
+    bool pop(T& value, const std::atomic<bool>& abort)
+    {
+      for (size_t attempt = 0; !tryPop(value); ++attempt)
+      {
+        if (abort.load(std::memory_order_relaxed))
+          return false;
+        backoff(attempt);
+      }
+      return true;
+    }
+    
+    /* spins for a while and then starts sleeping to avoid burning a core while the other side is stalled */
+    static void backoff(size_t attempt)
+    {
+      if (attempt < 64)
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    
+    size_t capacity() const { return _data.size(); }
+  };
+  
+  /* fixed size pool of workers which execute submitted tasks in FIFO order,
+     results and exceptions are forwarded to the caller through std::future */
+  class thread_pool
+  {
+  private:
+    std::vector<std::thread> _workers;
+    std::queue<std::function<void()>> _tasks;
+
+    std::mutex _lock;
+    std::condition_variable _condition;
+    bool _stopping;
+
+    void work()
+    {
+      while (true)
+      {
+        std::function<void()> task;
+
+        {
+          std::unique_lock<std::mutex> lock(_lock);
+          _condition.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+
+          if (_stopping && _tasks.empty())
+            return;
+
+          task = std::move(_tasks.front());
+          _tasks.pop();
+        }
+
+        task();
+      }
+    }
+
+  public:
+    thread_pool(size_t count) : _stopping(false)
+    {
+      count = std::max(count, size_t(1));
+
+      _workers.reserve(count);
+      for (size_t i = 0; i < count; ++i)
+        _workers.emplace_back([this] () { work(); });
+    }
+
+    ~thread_pool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stopping = true;
+      }
+
+      _condition.notify_all();
+
+      for (std::thread& worker : _workers)
+        worker.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    template<typename F, typename R = typename std::result_of<F()>::type>
+    std::future<R> submit(F&& function)
+    {
+      /* std::function requires copyable callables so the task is shared */
+      auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(function));
+      std::future<R> result = task->get_future();
+
+      {
+        std::lock_guard<std::mutex> lock(_lock);
+        _tasks.emplace([task] () { (*task)(); });
+      }
+
+      _condition.notify_one();
+      return result;
+    }
+
+    size_t size() const { return _workers.size(); }
+
+    static size_t hardwareConcurrency() { return std::max(std::thread::hardware_concurrency(), 1U); }
+  };
+}
@@ -83,6 +83,17 @@ namespace exceptions
     const char* what() const noexcept override { return _path.c_str(); }
   };
   
+  class error_writing_to_file : public exception
+  {
+  private:
+    path _path;
+    
+  public:
+    error_writing_to_file(const class path& path) : _path(path) { }
+    
+    const char* what() const noexcept override { return _path.c_str(); }
+  };
+  
   class parse_help_request : public exception
   {
   private:
@@ -114,6 +114,14 @@ public:
   
   ~file_handle() { if (_file) close(); }
   
+  /* anonymous temporary file which is removed when closed */
+  static file_handle temporary()
+  {
+    file_handle handle = file_handle(path());
+    handle._file = std::tmpfile();
+    return handle;
+  }
+  
   file_handle& operator=(file_handle& other) { this->_file = other._file; this->_path = other._path; other._file = nullptr; return *this; }
   file_handle(const file_handle& other) : _file(other._file), _path(other._path) { other._file = nullptr; }
   
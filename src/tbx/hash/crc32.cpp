@@ -13,10 +13,8 @@ namespace hash
 
   void crc32_digester::precomputeLUT()
   {
-    bool init = false;
-
-    if (!init)
-    {
+    /* table is shared by all digesters, function local static makes it computed once even when digesters are created concurrently */
+    static const bool init = [] () {
       for (u32 i = 0; i < 256; ++i)
       {
         u32 crc = i;
@@ -26,8 +24,10 @@ namespace hash
         lut[i] = crc;
       }
       
-      init = true;
-    }
+      return true;
+    }();
+    
+    (void)init;
   }
   
   crc32_t crc32_digester::update(const void* data, size_t length, crc32_t previous)
@@ -53,6 +53,73 @@ namespace hash
     return digester.get();
   }
 
+  crc32_t crc32_digester::computeRaw(const void* data, size_t length)
+  {
+    crc32_digester digester;
+    return ~digester.update(data, length, ~0U);
+  }
+  
+  /* same approach of zlib crc32_combine: the operator for a zero bit is a 32x32 matrix over GF(2)
+     which is squared repeatedly to obtain operators for 1, 2, 4.. zero bytes */
+  static u32 gf2_matrix_times(const u32* mat, u32 vec)
+  {
+    u32 sum = 0;
+    while (vec)
+    {
+      if (vec & 1)
+        sum ^= *mat;
+      vec >>= 1;
+      ++mat;
+    }
+    return sum;
+  }
+  
+  static void gf2_matrix_square(u32* square, const u32* mat)
+  {
+    for (size_t n = 0; n < 32; ++n)
+      square[n] = gf2_matrix_times(mat, mat[n]);
+  }
+  
+  crc32_t crc32_digester::shift(crc32_t crc, size_t length)
+  {
+    if (length == 0)
+      return crc;
+    
+    u32 even[32], odd[32];
+    
+    /* operator for one zero bit */
+    odd[0] = POLYNOMIAL;
+    u32 row = 1;
+    for (size_t n = 1; n < 32; ++n)
+    {
+      odd[n] = row;
+      row <<= 1;
+    }
+    
+    /* two and four zero bits */
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    
+    /* apply length zero bytes, first square gives operator for one byte */
+    do
+    {
+      gf2_matrix_square(even, odd);
+      if (length & 1)
+        crc = gf2_matrix_times(even, crc);
+      length >>= 1;
+      
+      if (!length)
+        break;
+      
+      gf2_matrix_square(odd, even);
+      if (length & 1)
+        crc = gf2_matrix_times(odd, crc);
+      length >>= 1;
+    } while (length);
+    
+    return crc;
+  }
+
   crc32_t crc32_digester::compute(const class path& path)
   {
     if (!path.exists())
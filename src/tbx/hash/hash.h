@@ -30,6 +30,14 @@ namespace hash
     
     static crc32_t compute(const void* data, size_t length);
     static crc32_t compute(const class path& path);
+    
+    /* crc without initial and final inversion, it's linear so patched bytes can be accounted as xor of old and new data */
+    static crc32_t computeRaw(const void* data, size_t length);
+    
+    /* advances crc as if length zero bytes were appended to the raw register */
+    static crc32_t shift(crc32_t crc, size_t length);
+    /* crc of concatenation of two blocks given their crcs and length of the second */
+    static crc32_t combine(crc32_t first, crc32_t second, size_t secondLength) { return shift(first, secondLength) ^ second; }
   };
 
   /* MD5 */
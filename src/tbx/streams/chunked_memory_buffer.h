@@ -0,0 +1,171 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/path.h"
+#include "tbx/streams/data_source.h"
+#include "tbx/streams/data_writer.h"
+
+#include <memory>
+#include <vector>
+
+/* buffer stored as a list of fixed size chunks, growing it just appends a new chunk so
+   data is never copied or moved and random access is a division away */
+class chunked_memory_buffer : public seekable_data_source, public data_writer
+{
+private:
+  std::vector<std::unique_ptr<byte[]>> _chunks;
+  const size_t _chunkSize;
+
+  mutable roff_t _position;
+  size_t _size;
+
+  void ensure_capacity(size_t capacity)
+  {
+    while (_chunks.size() * _chunkSize < capacity)
+    {
+      TRACE_MB("%p: chunked_memory_buffer::ensure_capacity (chunk: %lu, total: %lu)", this, _chunks.size(), _chunks.size() * _chunkSize);
+      _chunks.emplace_back(new byte[_chunkSize]);
+    }
+  }
+
+  /* chunks are not cleared when allocated so space left by seeking past the end is zeroed when written after */
+  void fill_gap()
+  {
+    if (_position > _size)
+    {
+      ensure_capacity(_position);
+      forEachPiece(_size, _position - _size, [] (byte* piece, size_t, size_t amount) { std::fill(piece, piece + amount, 0); });
+    }
+  }
+
+  /* calls function for each contiguous piece of [position, position+length) */
+  template<typename F> void forEachPiece(roff_t position, size_t length, F function) const
+  {
+    size_t done = 0;
+
+    while (done < length)
+    {
+      size_t chunk = (position + done) / _chunkSize;
+      size_t offset = (position + done) % _chunkSize;
+      size_t amount = std::min(length - done, _chunkSize - offset);
+
+      function(_chunks[chunk].get() + offset, done, amount);
+      done += amount;
+    }
+  }
+
+public:
+  chunked_memory_buffer(size_t chunkSize = MB1) : _chunkSize(chunkSize), _position(0), _size(0)
+  {
+    assert(chunkSize > 0);
+  }
+
+  chunked_memory_buffer(const chunked_memory_buffer&) = delete;
+  chunked_memory_buffer& operator=(const chunked_memory_buffer&) = delete;
+
+  size_t size() const override { return _size; }
+  size_t capacity() const { return _chunks.size() * _chunkSize; }
+  size_t chunkSize() const { return _chunkSize; }
+  size_t chunkCount() const { return _chunks.size(); }
+
+  roff_t tell() const override { return _position; }
+  roff_t position() const { return _position; }
+  bool eob() const { return _position == _size; }
+
+  void seek(roff_t offset) override { seek(offset, Seek::SET); }
+  void seek(roff_t offset, Seek origin) override
+  {
+    TRACE_MB("%p: chunked_memory_buffer::seek(%lu, %d)", this, offset, origin);
+
+    switch (origin) {
+      case Seek::CUR: _position += offset; break;
+      case Seek::SET: _position = offset; break;
+      case Seek::END: _position = _size + offset; break;
+    }
+  }
+
+  using data_writer::reserve;
+
+  void reserve(size_t size) override
+  {
+    fill_gap();
+    ensure_capacity(_position + size);
+    forEachPiece(_position, size, [] (byte* piece, size_t, size_t amount) { std::fill(piece, piece + amount, 0); });
+    _position += size;
+    _size = std::max(_size, (size_t)_position);
+  }
+
+  template<typename T> size_t write(const T& src) { return write(&src, sizeof(T), 1); }
+  size_t write(const void* data, size_t size, size_t count) override
+  {
+    const byte* src = static_cast<const byte*>(data);
+    const size_t length = size*count;
+
+    TRACE_MB("%p: chunked_memory_buffer::write(%lu, %lu)", this, size, count);
+
+    fill_gap();
+    ensure_capacity(_position + length);
+    forEachPiece(_position, length, [src] (byte* piece, size_t done, size_t amount) { std::copy(src + done, src + done + amount, piece); });
+
+    _position += length;
+    _size = std::max(_size, (size_t)_position);
+    return length;
+  }
+
+  template<typename T> size_t read(T& dest) { return read(&dest, sizeof(T), 1); }
+  size_t read(void* data, size_t size, size_t count) override
+  {
+    byte* dest = static_cast<byte*>(data);
+    size_t available = _position < _size ? std::min(_size - _position, (roff_t)size*count) : 0;
+
+    TRACE_MB("%p: chunked_memory_buffer::read(%lu, %lu)", this, size, count);
+
+    forEachPiece(_position, available, [dest] (byte* piece, size_t done, size_t amount) { std::copy(piece, piece + amount, dest + done); });
+    _position += available;
+    return available;
+  }
+
+  size_t read(byte* data, size_t amount) override
+  {
+    if (_position >= _size)
+      return END_OF_STREAM;
+
+    return read(data, 1, amount);
+  }
+
+  size_t write(const byte* data, size_t amount) override
+  {
+    if (amount != END_OF_STREAM)
+      return write(data, 1, amount);
+    else
+      return END_OF_STREAM;
+  }
+
+  /* writes the whole content to a sink without going through an intermediate buffer */
+  void writeTo(data_sink& sink) const
+  {
+    forEachPiece(0, _size, [&sink] (byte* piece, size_t, size_t amount) { sink.write(piece, amount); });
+  }
+
+  bool serialize(const file_handle& file) const
+  {
+    bool success = true;
+    forEachPiece(0, _size, [&file, &success] (byte* piece, size_t, size_t amount) { success &= file.write(piece, 1, amount) == amount; });
+    return success;
+  }
+
+  bool operator==(const chunked_memory_buffer& other) const
+  {
+    if (_size != other._size)
+      return false;
+
+    bool equal = true;
+    forEachPiece(0, _size, [&other, &equal] (byte* piece, size_t done, size_t amount) {
+      other.forEachPiece(done, amount, [piece, &equal] (byte* otherPiece, size_t offset, size_t length) {
+        equal = equal && std::equal(otherPiece, otherPiece + length, piece + offset);
+      });
+    });
+    return equal;
+  }
+  bool operator!=(const chunked_memory_buffer& other) const { return !operator==(other); }
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/hash/hash.h"
+#include "data_writer.h"
+
+#include <vector>
+#include <memory>
+
+/* forwards everything to another writer while keeping crc32 of all data past start offset,
+   appended data updates crc directly while overwritten regions are recorded as the raw crc
+   of old xor new bytes, which is moved to the end of the data when the crc is requested */
+class crc32_data_writer : public data_writer
+{
+private:
+  struct correction
+  {
+    hash::crc32_t delta;
+    roff_t end;
+  };
+
+  data_writer& _writer;
+  const roff_t _start;
+  const bool _enabled;
+
+  hash::crc32_digester _appended;
+  std::vector<correction> _corrections;
+
+  void patch(const byte* data, roff_t position, size_t length)
+  {
+    std::unique_ptr<byte[]> delta(new byte[length]);
+
+    _writer.seek(position, Seek::SET);
+    size_t read = _writer.read(delta.get(), 1, length);
+    assert(read == length);
+
+    for (size_t i = 0; i < read; ++i)
+      delta[i] ^= data[i];
+
+    _corrections.push_back({ hash::crc32_digester::computeRaw(delta.get(), length), static_cast<roff_t>(position + length) });
+  }
+
+  void track(const byte* data, size_t length)
+  {
+    roff_t position = _writer.tell();
+    roff_t end = position + length;
+    roff_t size = _writer.size();
+
+    /* data before start is not part of the checksum */
+    if (end <= _start)
+      return;
+    else if (position < _start)
+    {
+      data += _start - position;
+      position = _start;
+    }
+
+    /* part which overwrites existing data */
+    if (position < size)
+    {
+      roff_t mark = _writer.tell();
+      size_t overlap = std::min(end, size) - position;
+      patch(data, position, overlap);
+      _writer.seek(mark, Seek::SET);
+      
+      data += overlap;
+      position += overlap;
+    }
+
+    assert(position == end || position == std::max(size, _start));
+
+    if (position < end)
+      _appended.update(data, end - position);
+  }
+
+public:
+  using data_writer::write;
+  using data_writer::reserve;
+
+  crc32_data_writer(data_writer& writer, roff_t start, bool enabled = true) : _writer(writer), _start(start), _enabled(enabled) { }
+
+  size_t write(const void* data, size_t size, size_t count) override
+  {
+    if (_enabled)
+      track(static_cast<const byte*>(data), size*count);
+
+    return _writer.write(data, size, count);
+  }
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (amount != END_OF_STREAM)
+      return write(src, 1, amount);
+    else
+      return _writer.write(src, amount);
+  }
+
+  size_t read(void* data, size_t size, size_t count) override { return _writer.read(data, size, count); }
+
+  void seek(roff_t offset, Seek origin) override { _writer.seek(offset, origin); }
+  roff_t tell() const override { return _writer.tell(); }
+  size_t size() const override { return _writer.size(); }
+
+  void reserve(size_t size) override
+  {
+    /* reserved space is zero filled */
+    if (_enabled && tell() + static_cast<roff_t>(size) > _start)
+    {
+      static const byte zeroes[KB16] = { 0 };
+      for (size_t remaining = std::min(size, size_t(tell() + size - _start)); remaining > 0; )
+      {
+        size_t amount = std::min(remaining, KB16);
+        _appended.update(zeroes, amount);
+        remaining -= amount;
+      }
+    }
+
+    _writer.reserve(size);
+  }
+
+  /* crc32 of data from start to current end of the writer */
+  hash::crc32_t get() const
+  {
+    hash::crc32_t crc = _appended.get();
+    const size_t size = _writer.size();
+
+    for (const correction& correction : _corrections)
+      crc ^= hash::crc32_digester::shift(correction.delta, size - correction.end);
+
+    return crc;
+  }
+};
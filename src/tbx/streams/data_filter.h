@@ -131,7 +131,7 @@ protected:
   {
     memory_buffer& in = _filter.in();
     
-    if (!in.full())
+    if (!in.full() && !_filter.finished())
     {
       size_t effective = _source->read(in.tail(), in.available());
       
@@ -187,6 +187,11 @@ public:
       _filter.process();
       
       size_t effective = dumpOutput(dest, amount);
+    
+      /* filter could finish before its source, eg. a compressed stream followed by unrelated data,
+         remaining input is not needed anymore */
+      if (_filter.finished() && !_filter.ended())
+        _filter.markEnded();
       
       if (_filter.ended() && _filter.finished())
       {
@@ -219,7 +224,7 @@ protected:
   {
     memory_buffer& in = _filter.in();
     
-    if (!in.full())
+    if (!in.full() && !_filter.finished())
     {
       size_t effective = std::min(in.available(), length);
       std::copy(src, src + effective, in.tail());
@@ -2,6 +2,8 @@
 
 #include "tbx/base/common.h"
 
+#include <memory>
+
 constexpr size_t END_OF_STREAM = 0xFFFFFFFFFFFFFFFFLL;
 
 struct data_source
@@ -10,6 +12,24 @@ struct data_source
   virtual size_t read(byte* dest, size_t amount) = 0;
   template<typename T> void read(T& dest) { assert(read((byte*)&dest, sizeof(T)) == sizeof(T)); }
   
+  /* sources are allowed to return 0 while they are still producing so this keeps reading until amount or end */
+  size_t readFully(byte* dest, size_t amount)
+  {
+    size_t done = 0;
+    
+    while (done < amount)
+    {
+      size_t effective = read(dest + done, amount - done);
+      
+      if (effective == END_OF_STREAM)
+        break;
+      
+      done += effective;
+    }
+    
+    return done;
+  }
+  
   virtual bool isSeekable() const { return false; }
 };
 
@@ -32,7 +52,12 @@ struct seekable
   void rewind() { seek(0); }
 };
 
-struct seekable_data_source : public data_source, public seekable { };
+struct seekable_data_source : public data_source, public seekable
+{
+  /* [offset, offset+length) shared in place with the caller, it stays valid after the source is released,
+     nullptr if the source can't expose its data this way */
+  virtual std::shared_ptr<const byte> view(roff_t offset, size_t length) const { return nullptr; }
+};
 struct seekable_data_sink : public data_sink, public seekable { };
 struct seekable_data : public data_source, public data_sink, public seekable { };
 struct data : public data_source, public data_sink { };
@@ -86,29 +111,71 @@ public:
 
 #pragma seekable slice
 
+/* view over a range of source with its own position, source position is left untouched */
 class seekable_source_slice : public seekable_data_source
 {
 private:
   seekable_data_source* const _source;
+  const roff_t _offset;
+  const size_t _length;
   roff_t _position;
   
 public:
-  seekable_source_slice(seekable_data_source* source) : _source(source) { }
+  seekable_source_slice(seekable_data_source* source) : _source(source), _offset(0), _length(END_OF_STREAM), _position(0) { }
+  seekable_source_slice(seekable_data_source* source, roff_t offset, size_t length) : _source(source), _offset(offset), _length(length), _position(0) { }
   
   virtual void seek(roff_t position) { _position = position; }
   virtual roff_t tell() const { return _position; }
-  virtual size_t size() const { return _source->size(); }
+  virtual size_t size() const { return _length != END_OF_STREAM ? _length : _source->size(); }
   virtual size_t read(byte* dest, size_t amount)
   {
+    if (_length != END_OF_STREAM)
+    {
+      if (static_cast<size_t>(_position) >= _length)
+        return END_OF_STREAM;
+      
+      amount = std::min(amount, _length - static_cast<size_t>(_position));
+    }
+    
     roff_t mark = _source->tell();
-    _source->seek(_position);
+    _source->seek(_offset + _position);
     size_t effective = _source->read(dest, amount);
     _source->seek(mark);
-    _position += effective;
+    if (effective != END_OF_STREAM)
+      _position += effective;
     return effective;
   }
 };
 
+#pragma bounded source
+
+/* passes through at most length bytes of source without ever reading past them,
+   so that a source can be consumed by multiple consecutive readers */
+class bounded_data_source : public data_source
+{
+private:
+  data_source* const _source;
+  size_t _remaining;
+  
+public:
+  bounded_data_source(data_source* source, size_t length) : _source(source), _remaining(length) { }
+  
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (_remaining == 0)
+      return END_OF_STREAM;
+    
+    size_t effective = _source->read(dest, std::min(amount, _remaining));
+    
+    if (effective != END_OF_STREAM)
+      _remaining -= effective;
+    
+    return effective;
+  }
+  
+  size_t remaining() const { return _remaining; }
+};
+
 #pragma multiple source
 
 class multiple_data_source : public data_source
@@ -117,6 +184,7 @@ private:
   using iterator = std::vector<data_source*>::const_iterator;
   
   bool _pristine;
+  bool _paused;
   std::function<void(data_source*)> _onBegin;
   std::function<void(data_source*)> _onEnd;
   
@@ -125,17 +193,22 @@ private:
   
 public:
   multiple_data_source(const std::vector<data_source*>& sources) :
-  _pristine(true), _sources(sources), _it(_sources.begin()),
+  _pristine(true), _paused(false), _sources(sources), _it(_sources.begin()),
   _onBegin([](data_source*){}), _onEnd([](data_source*){}) {}
   
   void setOnBegin(std::function<void(data_source*)> onBegin) { this->_onBegin = onBegin; }
   void setOnEnd(std::function<void(data_source*)> onEnd) { this->_onEnd = onEnd; }
   
   size_t count() const { return _sources.size(); }
+  bool ended() const { return _it == _sources.end(); }
+  
+  /* when paused the source ends after the current inner source has ended, until resumed */
+  void pause() { _paused = true; }
+  void resume() { _paused = false; }
   
   size_t read(byte* dest, size_t amount) override
   {
-    if (_it == _sources.end())
+    if (_it == _sources.end() || _paused)
       return END_OF_STREAM;
 
     size_t effective = END_OF_STREAM;
@@ -154,6 +227,9 @@ public:
         _onEnd(*_it);
         ++_it;
         _pristine = true;
+        
+        if (_paused)
+          break;
       }
     }
     
@@ -182,6 +258,7 @@ private:
   
 public:
   multiple_fixed_size_sink_policy(sink_factory factory, const std::initializer_list<size_t> sizes) : _sizes(sizes), _factory(factory), _leftAmount(0) { }
+  multiple_fixed_size_sink_policy(sink_factory factory, const std::vector<size_t>& sizes) : _sizes(sizes), _factory(factory), _leftAmount(0) { }
   ~multiple_fixed_size_sink_policy() { std::for_each(_sinks.begin(), _sinks.end(), [] (data_sink* sink) { delete sink; }); }
   
   size_t availableToWrite(data_sink* sink, size_t requested) override
@@ -250,6 +327,24 @@ public:
   data_sink* operator[](size_t index) const { return _sinks[index]; }
 };
 
+/* writes the same data to all the sinks it owns */
+class broadcast_data_sink : public data_sink
+{
+private:
+  std::vector<std::unique_ptr<data_sink>> _sinks;
+  
+public:
+  broadcast_data_sink(std::vector<std::unique_ptr<data_sink>>&& sinks) : _sinks(std::move(sinks)) { }
+  
+  size_t write(const byte* src, size_t amount) override
+  {
+    for (const auto& sink : _sinks)
+      sink->write(src, amount);
+    
+    return amount;
+  }
+};
+
 template<typename S>
 class lambda_init_data_source : public S
 {
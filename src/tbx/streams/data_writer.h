@@ -0,0 +1,113 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/streams/data_source.h"
+
+enum class Seek
+{
+  SET = SEEK_SET,
+  END = SEEK_END,
+  CUR = SEEK_CUR
+};
+
+template<typename T> class data_reference;
+template<typename T> class array_reference;
+
+/* random access sink which allows to reserve space and fill it later through
+   data_reference / array_reference, this is what an archive is written to */
+class data_writer : public data_sink
+{
+public:
+  using data_sink::write;
+
+  virtual size_t write(const void* data, size_t size, size_t count) = 0;
+  virtual size_t read(void* data, size_t size, size_t count) = 0;
+
+  virtual void seek(roff_t offset, Seek origin) = 0;
+  virtual roff_t tell() const = 0;
+  virtual size_t size() const = 0;
+
+  /* advances position by size bytes, reserved space is zero filled and meant to be overwritten later */
+  virtual void reserve(size_t size) = 0;
+
+  template<typename T> size_t write(const T& src) { return write(&src, sizeof(T), 1); }
+  template<typename T> size_t read(T& dest) { return read(&dest, sizeof(T), 1); }
+
+  template<typename T> data_reference<T> reserve();
+  template<typename T> array_reference<T> reserveArray(size_t size);
+};
+
+template<typename T>
+class data_reference
+{
+private:
+  data_writer* _buffer;
+  roff_t _position;
+  data_reference(data_writer& buffer, roff_t position) : _buffer(&buffer), _position(position) { }
+
+public:
+  data_reference() : _buffer(nullptr), _position(0) { }
+  operator roff_t() const { return _position; }
+
+  void write(const T& value)
+  {
+    assert(_buffer);
+    roff_t mark = _buffer->tell();
+    _buffer->seek(_position, Seek::SET);
+    _buffer->write(&value, sizeof(T), 1);
+    _buffer->seek(mark, Seek::SET);
+  }
+
+  friend class data_writer;
+};
+
+template<typename T>
+class array_reference
+{
+private:
+  data_writer* _buffer;
+  roff_t _position;
+  size_t _count;
+  array_reference(data_writer& buffer, roff_t position, size_t count) : _buffer(&buffer), _position(position), _count(count) { }
+
+public:
+  array_reference() : _buffer(nullptr), _position(0) { }
+  operator roff_t() const { return _position; }
+  size_t count() const { return _count; }
+
+  void write(const T& value, size_t index)
+  {
+    assert(_buffer);
+    roff_t mark = _buffer->tell();
+    _buffer->seek(_position + sizeof(T)*index, Seek::SET);
+    _buffer->write(&value, sizeof(T), 1);
+    _buffer->seek(mark, Seek::SET);
+  }
+
+  void read(T& value, size_t index)
+  {
+    assert(_buffer);
+    roff_t mark = _buffer->tell();
+    _buffer->seek(_position + sizeof(T)*index, Seek::SET);
+    _buffer->read(value);
+    _buffer->seek(mark, Seek::SET);
+  }
+
+  friend class data_writer;
+};
+
+template<typename T> data_reference<T> data_writer::reserve()
+{
+  roff_t mark = tell();
+  assert(mark == size());
+  reserve(sizeof(T));
+  return data_reference<T>(*this, mark);
+}
+
+template<typename T> array_reference<T> data_writer::reserveArray(size_t size)
+{
+  roff_t mark = tell();
+  assert(mark == this->size());
+  reserve(sizeof(T)*size);
+  return array_reference<T>(*this, mark, size);
+}
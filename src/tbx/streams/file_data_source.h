@@ -1,6 +1,7 @@
 #pragma once
 
 #include "data_source.h"
+#include "data_writer.h"
 #include "tbx/base/path.h"
 
 class file_data_source : public seekable_data_source
@@ -85,6 +86,69 @@ public:
   }
 };
 
+class file_data_writer : public data_writer
+{
+private:
+  path _path;
+  file_handle _handle;
+  size_t _size;
+  
+public:
+  /* APPENDING opens an existing file for update, positioned at its beginning */
+  file_data_writer(const path& path, file_mode mode = file_mode::WRITING) : _path(path), _handle(path, mode), _size(0)
+  {
+    if (!_handle)
+      throw exceptions::error_opening_file(path);
+    
+    if (mode == file_mode::APPENDING)
+      _size = _handle.length();
+  }
+  
+  size_t write(const void* data, size_t size, size_t count) override
+  {
+    size_t effective = _handle.write(data, 1, size*count);
+    _size = std::max(_size, (size_t)_handle.tell());
+    TRACE_F("%p: file_data_writer::write(%lu/%lu)", this, effective, _size);
+    return effective;
+  }
+  
+  size_t read(void* data, size_t size, size_t count) override
+  {
+    return _handle.read(data, 1, size*count);
+  }
+  
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (amount != END_OF_STREAM)
+      return write(src, 1, amount);
+    else
+      return END_OF_STREAM;
+  }
+  
+  void seek(roff_t offset, Seek origin) override
+  {
+    TRACE_F("%p: file_data_writer::seek(%lu, %d)", this, offset, origin);
+    _handle.seek(offset, static_cast<int>(origin));
+  }
+  
+  roff_t tell() const override { return _handle.tell(); }
+  size_t size() const override { return _size; }
+  
+  void reserve(size_t size) override
+  {
+    static const byte zeroes[KB16] = { 0 };
+    
+    while (size > 0)
+    {
+      size_t amount = std::min(size, KB16);
+      write(zeroes, 1, amount);
+      size -= amount;
+    }
+  }
+  
+  void flush() { _handle.flush(); }
+};
+
 #include <list>
 #include <unordered_map>
 
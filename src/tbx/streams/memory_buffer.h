@@ -2,18 +2,9 @@
 
 #include "tbx/base/common.h"
 #include "tbx/streams/data_source.h"
+#include "tbx/streams/data_writer.h"
 
-enum class Seek
-{
-  SET = SEEK_SET,
-  END = SEEK_END,
-  CUR = SEEK_CUR
-};
-
-template<typename T> class data_reference;
-template<typename T> class array_reference;
-
-class memory_buffer : public seekable_data_source, public data_sink
+class memory_buffer : public seekable_data_source, public data_writer
 {
 private:
   byte* _data;
@@ -30,7 +21,8 @@ public:
     TRACE_MB("%p: memory_buffer::new(%lu)", this, capacity);
   }
 
-  memory_buffer() : memory_buffer(0)
+  /* an empty buffer allocates nothing until it's written */
+  memory_buffer() : _data(nullptr), _capacity(0), _size(0), _position(0), _dataOwned(true)
   {
     static_assert(sizeof(roff_t) == 8, "");
     static_assert(sizeof(size_t) == 8, "");
@@ -117,7 +109,7 @@ public:
   roff_t tell() const override { return _position; }
   
   void seek(roff_t offset) override { seek(offset, Seek::SET); }
-  void seek(roff_t offset, Seek origin)
+  void seek(roff_t offset, Seek origin) override
   {
     TRACE_MB("%p: memory_buffer::seek(%lu, %d)", this, offset, origin);
 
@@ -143,18 +135,18 @@ public:
     }
   }
 
-  template<typename T> data_reference<T> reserve();
-  template<typename T> array_reference<T> reserveArray(size_t size);
+  using data_writer::reserve;
   
-  void reserve(size_t size)
+  void reserve(size_t size) override
   {
     ensure_capacity(_position + size);
+    std::fill(_data + _position, _data + _position + size, 0);
     _position += size;
     _size += size;
   }
   
   template<typename T> size_t write(const T& src) { return write(&src, sizeof(T), 1); }
-  size_t write(const void* data, size_t size, size_t count)
+  size_t write(const void* data, size_t size, size_t count) override
   {
     size_t requiredCapacity = _position + size*count;
     
@@ -173,7 +165,7 @@ public:
   }
   
   template<typename T> size_t read(T& dest) { return read(&dest, sizeof(T), 1); }
-  size_t read(void* data, size_t size, size_t count)
+  size_t read(void* data, size_t size, size_t count) override
   {
     TRACE_MB("%p: memory_buffer::read(%lu, %lu)", this, size, count);
 
@@ -278,80 +270,3 @@ public:
   byte* head() { return _data; }
   byte* tail() { return _data + _size; }
 };
-
-template<typename T>
-class data_reference
-{
-private:
-  memory_buffer* _buffer;
-  roff_t _position;
-  data_reference(memory_buffer& buffer, roff_t position) : _buffer(&buffer), _position(position) { }
-  
-public:
-  data_reference() : _buffer(nullptr), _position(0) { }
-  operator roff_t() const { return _position; }
-
-  void write(const T& value)
-  {
-    assert(_buffer);
-    roff_t mark = _buffer->tell();
-    _buffer->seek(_position, Seek::SET);
-    _buffer->write(&value, sizeof(T), 1);
-    _buffer->seek(mark, Seek::SET);
-  }
-
-  friend class memory_buffer;
-};
-
-template<typename T>
-class array_reference
-{
-private:
-  memory_buffer* _buffer;
-  roff_t _position;
-  size_t _count;
-  array_reference(memory_buffer& buffer, roff_t position, size_t count) : _buffer(&buffer), _position(position), _count(count) { }
-  
-public:
-  array_reference() : _buffer(nullptr), _position(0) { }
-  operator roff_t() const { return _position; }
-  size_t count() const { return _count; }
-  
-  void write(const T& value, size_t index)
-  {
-    assert(_buffer);
-    roff_t mark = _buffer->tell();
-    _buffer->seek(_position + sizeof(T)*index, Seek::SET);
-    _buffer->write(&value, sizeof(T), 1);
-    _buffer->seek(mark, Seek::SET);
-  }
-  
-  void read(T& value, size_t index)
-  {
-    assert(_buffer);
-    roff_t mark = _buffer->tell();
-    _buffer->seek(_position + sizeof(T)*index, Seek::SET);
-    _buffer->read(value);
-    _buffer->seek(mark, Seek::SET);
-  }
-  
-  friend class memory_buffer;
-};
-
-template<typename T> data_reference<T> memory_buffer::reserve()
-{
-  roff_t mark = tell();
-  assert(mark == _size);
-  reserve(sizeof(T));
-  //_size += sizeof(T);
-  return data_reference<T>(*this, mark);
-}
-
-template<typename T> array_reference<T> memory_buffer::reserveArray(size_t size)
-{
-  roff_t mark = tell();
-  assert(mark == _size);
-  reserve(sizeof(T)*size);
-  //_size += sizeof(T)*size;
-  return array_reference<T>(*this, mark, size);
-}
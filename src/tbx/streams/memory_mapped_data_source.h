@@ -0,0 +1,125 @@
+#pragma once
+
+#include "data_source.h"
+#include "tbx/base/path.h"
+#include "tbx/base/exceptions.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#if _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* read only source backed by a memory mapping of the whole file, reading is a copy from
+   the mapping and view() shares data in place without any copy at all, the mapping
+   is released when both the source and all the views are gone */
+class memory_mapped_data_source : public seekable_data_source
+{
+private:
+  path _path;
+  std::shared_ptr<const byte> _data;
+  size_t _length;
+  roff_t _position;
+
+  void map()
+  {
+#if _WIN32
+    HANDLE file = CreateFileA(_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+      throw exceptions::error_opening_file(_path);
+
+    LARGE_INTEGER length;
+    GetFileSizeEx(file, &length);
+    _length = static_cast<size_t>(length.QuadPart);
+
+    /* an empty file can't be mapped, view stays valid after handles are closed */
+    if (_length > 0)
+    {
+      HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      const void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+      if (mapping)
+        CloseHandle(mapping);
+      CloseHandle(file);
+
+      if (!data)
+        throw exceptions::error_opening_file(_path);
+
+      _data.reset(static_cast<const byte*>(data), [] (const byte* data) { UnmapViewOfFile(data); });
+    }
+    else
+      CloseHandle(file);
+#else
+    /* fcntl.h can't be included since it declares its own file_handle so descriptor comes from a stream */
+    FILE* file = std::fopen(_path.c_str(), "rb");
+
+    if (!file)
+      throw exceptions::error_opening_file(_path);
+
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0)
+    {
+      std::fclose(file);
+      throw exceptions::error_opening_file(_path);
+    }
+
+    _length = static_cast<size_t>(info.st_size);
+
+    /* an empty file can't be mapped, mapping stays valid after file is closed */
+    if (_length > 0)
+    {
+      void* data = mmap(nullptr, _length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+      std::fclose(file);
+
+      if (data == MAP_FAILED)
+        throw exceptions::error_opening_file(_path);
+
+      const size_t length = _length;
+      _data.reset(static_cast<const byte*>(data), [length] (const byte* data) { munmap(const_cast<byte*>(data), length); });
+    }
+    else
+      std::fclose(file);
+#endif
+
+    TRACE_F("%p: memory_mapped_data_source::map(%s, %lu)", this, _path.c_str(), _length);
+  }
+
+public:
+  memory_mapped_data_source(const path& path) : _path(path), _length(0), _position(0)
+  {
+    map();
+  }
+
+  memory_mapped_data_source(const memory_mapped_data_source&) = delete;
+  memory_mapped_data_source& operator=(const memory_mapped_data_source&) = delete;
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (_position >= _length)
+      return END_OF_STREAM;
+
+    size_t effective = std::min(amount, static_cast<size_t>(_length - _position));
+    std::memcpy(dest, _data.get() + _position, effective);
+    _position += effective;
+
+    return effective;
+  }
+
+  std::shared_ptr<const byte> view(roff_t offset, size_t length) const override
+  {
+    return offset + length <= _length && _data ? std::shared_ptr<const byte>(_data, _data.get() + offset) : nullptr;
+  }
+
+  void seek(roff_t position) override { _position = position; }
+  roff_t tell() const override { return _position; }
+  size_t size() const override { return _length; }
+};
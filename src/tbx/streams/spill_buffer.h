@@ -0,0 +1,149 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/path.h"
+#include "tbx/base/exceptions.h"
+#include "data_source.h"
+#include "chunked_memory_buffer.h"
+
+#include <atomic>
+#include <memory>
+
+/* amount of memory shared by multiple buffers, it's acquired and released in chunks
+   and can be used concurrently from multiple threads */
+class memory_budget
+{
+private:
+  std::atomic<size_t> _available;
+
+public:
+  memory_budget(size_t size) : _available(size) { }
+
+  bool acquire(size_t amount)
+  {
+    size_t available = _available.load(std::memory_order_relaxed);
+
+    while (available >= amount)
+    {
+      if (_available.compare_exchange_weak(available, available - amount))
+        return true;
+    }
+
+    return false;
+  }
+
+  void release(size_t amount) { _available += amount; }
+  size_t available() const { return _available; }
+};
+
+/* sink which keeps data in fixed size chunks while budget allows it and then
+   continues on a temporary file, data is never moved once written */
+class spill_buffer : public data_sink
+{
+private:
+  memory_budget& _budget;
+  const size_t _chunkSize;
+
+  chunked_memory_buffer _memory;
+
+  std::unique_ptr<file_handle> _file;
+  size_t _spilled;
+
+  size_t append(const byte* src, size_t amount)
+  {
+    size_t room = _memory.capacity() - _memory.size();
+
+    /* a new chunk is allocated by the buffer only when budget allows it */
+    if (room == 0)
+    {
+      if (!_budget.acquire(_chunkSize))
+        return 0;
+
+      room = _chunkSize;
+    }
+
+    size_t effective = std::min(amount, room);
+    _memory.write(src, 1, effective);
+    return effective;
+  }
+
+  void spill(const byte* src, size_t amount)
+  {
+    if (!_file)
+    {
+      _file.reset(new file_handle(file_handle::temporary()));
+
+      if (!*_file)
+        throw exceptions::error_opening_file(path("temporary spill file"));
+
+      TRACE_A("%p: spill_buffer::spill() budget exhausted after %lu bytes, continuing on temporary file", this, inMemory());
+    }
+
+    if (_file->write(src, 1, amount) != amount)
+      throw exceptions::error_writing_to_file(path("temporary spill file"));
+
+    _spilled += amount;
+  }
+
+public:
+  spill_buffer(memory_budget& budget, size_t chunkSize = MB1) : _budget(budget), _chunkSize(chunkSize), _memory(chunkSize), _spilled(0) { }
+
+  ~spill_buffer() { _budget.release(_memory.capacity()); }
+
+  spill_buffer(const spill_buffer&) = delete;
+  spill_buffer& operator=(const spill_buffer&) = delete;
+
+  size_t write(const byte* src, size_t amount) override
+  {
+    if (amount == END_OF_STREAM)
+      return END_OF_STREAM;
+
+    size_t remaining = amount;
+
+    /* once something has been spilled everything else must follow it to keep order */
+    while (remaining > 0 && !_file)
+    {
+      size_t effective = append(src, remaining);
+
+      if (effective == 0)
+        break;
+
+      src += effective;
+      remaining -= effective;
+    }
+
+    if (remaining > 0)
+      spill(src, remaining);
+
+    return amount;
+  }
+
+  /* writes the whole content to another sink in order */
+  void writeTo(data_sink& sink, size_t bufferSize) const
+  {
+    _memory.writeTo(sink);
+
+    if (_file)
+    {
+      std::unique_ptr<byte[]> buffer(new byte[bufferSize]);
+      _file->rewind();
+
+      for (size_t remaining = _spilled; remaining > 0; )
+      {
+        size_t read = _file->read(buffer.get(), 1, std::min(remaining, bufferSize));
+
+        if (read == 0)
+          throw exceptions::error_reading_from_file(path("temporary spill file"));
+
+        sink.write(buffer.get(), read);
+        remaining -= read;
+      }
+
+      _file->seek(0, SEEK_END);
+    }
+  }
+
+  size_t inMemory() const { return _memory.size(); }
+  size_t spilled() const { return _spilled; }
+  size_t size() const { return inMemory() + _spilled; }
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "tbx/base/common.h"
+#include "tbx/base/concurrency.h"
+#include "data_source.h"
+
+#include <memory>
+#include <exception>
+
+/* pulls data from source on a dedicated thread and hands it over through a bounded
+   queue of chunks, everything upstream of this source runs on that thread so that
+   a chain of these forms a pipeline of stages. The thread is started and chunks are
+   allocated on first read, they're released once the stream has ended. */
+class threaded_data_source : public data_source
+{
+private:
+  struct chunk
+  {
+    byte* data;
+    size_t length;
+  };
+
+  data_source* const _source;
+  const size_t _chunkSize;
+  const size_t _chunkCount;
+
+  std::unique_ptr<byte[]> _storage;
+  concurrency::spsc_queue<chunk> _filled;
+  concurrency::spsc_queue<chunk> _free;
+
+  std::thread _worker;
+  std::atomic<bool> _abort;
+  std::exception_ptr _error;
+
+  chunk _current;
+  size_t _position;
+  bool _started;
+  bool _ended;
+
+  void work()
+  {
+    try
+    {
+      chunk chunk;
+
+      while (_free.pop(chunk, _abort))
+      {
+        size_t effective = 0;
+
+        /* sources are allowed to return 0 while they are still producing */
+        while (effective == 0 && !_abort)
+          effective = _source->read(chunk.data, _chunkSize);
+
+        chunk.length = effective;
+
+        if (!_filled.push(chunk, _abort) || effective == END_OF_STREAM)
+          return;
+      }
+    }
+    catch (...)
+    {
+      /* exception is forwarded to the consumer thread */
+      _error = std::current_exception();
+      _filled.push({ nullptr, END_OF_STREAM }, _abort);
+    }
+  }
+
+public:
+  threaded_data_source(data_source* source, size_t chunkSize, size_t chunkCount = 4) :
+    _source(source), _chunkSize(chunkSize), _chunkCount(chunkCount),
+    _filled(chunkCount), _free(chunkCount), _abort(false),
+    _current({ nullptr, 0 }), _position(0), _started(false), _ended(false) { }
+
+  ~threaded_data_source()
+  {
+    _abort = true;
+    if (_worker.joinable())
+      _worker.join();
+  }
+
+  size_t read(byte* dest, size_t amount) override
+  {
+    if (_ended)
+      return END_OF_STREAM;
+
+    if (!_started)
+    {
+      _started = true;
+      _storage.reset(new byte[_chunkSize*_chunkCount]);
+
+      for (size_t i = 0; i < _chunkCount; ++i)
+        _free.tryPush({ _storage.get() + i*_chunkSize, 0 });
+
+      _worker = std::thread([this] () { work(); });
+    }
+
+    if (_position == _current.length)
+    {
+      _filled.pop(_current, _abort);
+      _position = 0;
+
+      if (_current.length == END_OF_STREAM)
+      {
+        _ended = true;
+        _worker.join();
+        _storage.reset();
+
+        if (_error)
+          std::rethrow_exception(_error);
+
+        return END_OF_STREAM;
+      }
+    }
+
+    size_t effective = std::min(amount, _current.length - _position);
+    std::copy(_current.data + _position, _current.data + _position + effective, dest);
+    _position += effective;
+
+    /* chunk has been fully consumed so it's given back to the producer */
+    if (_position == _current.length)
+      _free.tryPush(_current);
+
+    return effective;
+  }
+};
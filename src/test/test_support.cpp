@@ -65,6 +65,51 @@ void testing::ArchiveTester::release(const ArchiveFactory::Data& data)
   //    delete filter;
 }
 
+void testing::ArchiveTester::roundtrip(Archive& archive, memory_buffer& output, Archive& verify)
+{
+  archive.write(output);
+  output.rewind();
+  verify.read(output);
+}
+
+std::vector<memory_buffer> testing::ArchiveTester::extract(Archive& archive, R& r)
+{
+  std::vector<memory_buffer> extracted(archive.entries().size());
+  
+  archive.extract(r, [&extracted, &archive] (const ArchiveEntry& entry) {
+    return std::unique_ptr<data_sink>(new forwarding_sink(&extracted[&entry - archive.entries().data()]));
+  });
+  
+  return extracted;
+}
+
+void testing::ArchiveTester::verifyExtraction(Archive& archive, R& r, const std::vector<const memory_buffer*>& expected)
+{
+  std::vector<memory_buffer> extracted = extract(archive, r);
+  
+  REQUIRE(extracted.size() == expected.size());
+  for (size_t i = 0; i < expected.size(); ++i)
+    REQUIRE(extracted[i] == *expected[i]);
+}
+
+void testing::ArchiveTester::verifyExtraction(Archive& archive, R& r, const ArchiveFactory::Data& data)
+{
+  std::vector<const memory_buffer*> expected;
+  for (const auto& entry : data.entries)
+    expected.push_back(static_cast<const memory_buffer*>(entry.source));
+  
+  verifyExtraction(archive, r, expected);
+}
+
+void testing::ArchiveTester::verifyExtraction(Archive& archive, R& r, const data_source_vector& sources)
+{
+  std::vector<const memory_buffer*> expected;
+  for (const auto& source : sources)
+    expected.push_back(static_cast<const memory_buffer*>(source.source.get()));
+  
+  verifyExtraction(archive, r, expected);
+}
+
 void testing::ArchiveTester::verifyFilters(const std::vector<filter_builder*>& original, const filter_builder_queue& match)
 {
   for (size_t j = 0; j < original.size(); ++j)
@@ -198,6 +243,19 @@ void testing::ArchiveTester::verify(const ArchiveFactory::Data& data, const Arch
   }
   
   
+  /* verify seek table section header */
+  const size_t seekPoints = std::accumulate(verify.streams().begin(), verify.streams().end(), 0UL, [](size_t count, const ArchiveStream& stream) {
+    return count + stream.seekPoints().size();
+  });
+  
+  if (seekPoints > 0)
+  {
+    REQUIRE(verify.section(box::Section::SEEK_TABLE));
+    REQUIRE(verify.section(box::Section::SEEK_TABLE)->count == seekPoints);
+  }
+  else
+    REQUIRE(verify.section(box::Section::SEEK_TABLE) == nullptr);
+  
   /* size of archive must match, header + entry*entries + stream*streams + entry names */
   size_t archiveSize = sizeof(box::Header)
   + sizeof(box::Entry) * data.entries.size()
@@ -205,6 +263,9 @@ void testing::ArchiveTester::verify(const ArchiveFactory::Data& data, const Arch
   + ((!data.entries.empty() && !data.streams.empty()) ? sizeof(box::SectionHeader)*4 : 0) /* entry table, stream table, stream data, entry names section headers */
   + (payloadSizeForEntries > 0 ? sizeof(box::SectionHeader) : 0)
   + (payloadSizeForStream > 0 ? sizeof(box::SectionHeader) : 0)
+  + (seekPoints > 0 ? sizeof(box::SectionHeader) + sizeof(box::SeekPoint) * seekPoints : 0)
+  + (verify.section(box::Section::NAME_INDEX) ? sizeof(box::SectionHeader) + verify.section(box::Section::NAME_INDEX)->size : 0)
+  + (verify.section(box::Section::DIGEST_INDEX) ? sizeof(box::SectionHeader) + verify.section(box::Section::DIGEST_INDEX)->size : 0)
   + std::accumulate(verify.streams().begin(), verify.streams().end(), 0UL, [] (size_t count, const ArchiveStream& entry) { return entry.binary().length + count; })
   + std::accumulate(data.entries.begin(), data.entries.end(), 0UL, [] (size_t count, const ArchiveFactory::Entry& entry) { return entry.name.length() + 1 + count; })
   + payloadSizeForEntries + payloadSizeForStream;
@@ -4,6 +4,7 @@
 #include "tbx/streams/memory_buffer.h"
 
 #include "box/archive.h"
+#include "box/archive_builder.h"
 
 #include <random>
 
@@ -18,11 +19,42 @@ namespace testing
   
   void createDummyFile(const path& path);
   
+  /* forwards to a sink owned by the test so that it can be handed over to code which releases its sinks */
+  struct forwarding_sink : public data_sink
+  {
+    data_sink* sink;
+    forwarding_sink(data_sink* sink) : sink(sink) { }
+    size_t write(const byte* src, size_t amount) override { return sink->write(src, amount); }
+  };
+  
+  /* seekable source which counts reads made on another one and never exposes its data in place */
+  struct counting_source : public seekable_data_source
+  {
+    seekable_data_source* source;
+    size_t reads;
+    counting_source(seekable_data_source* source) : source(source), reads(0) { }
+    size_t read(byte* dest, size_t amount) override { ++reads; return source->read(dest, amount); }
+    void seek(roff_t position) override { source->seek(position); }
+    roff_t tell() const override { return source->tell(); }
+    size_t size() const override { return source->size(); }
+  };
+  
   struct ArchiveTester
   {
     static void release(const ArchiveFactory::Data& data);
     static void verifyFilters(const std::vector<filter_builder*>& original, const filter_builder_queue& match);
     static void verify(const ArchiveFactory::Data& data, const Archive& verify, memory_buffer& buffer);
+    
+    /* writes archive into output and reads it back into verify, which can be configured before, output is left rewound */
+    static void roundtrip(Archive& archive, memory_buffer& output, Archive& verify);
+    
+    /* extracts every entry of archive from r, data is in entry order */
+    static std::vector<memory_buffer> extract(Archive& archive, R& r);
+    
+    /* extracts every entry of archive from r and checks it against the source of the entry at same index */
+    static void verifyExtraction(Archive& archive, R& r, const std::vector<const memory_buffer*>& expected);
+    static void verifyExtraction(Archive& archive, R& r, const ArchiveFactory::Data& data);
+    static void verifyExtraction(Archive& archive, R& r, const data_source_vector& sources);
   };
   
   struct Xdelta3Tester
@@ -9,18 +9,29 @@
 #include "tbx/streams/memory_buffer.h"
 #include "tbx/streams/data_source.h"
 #include "tbx/streams/file_data_source.h"
+#include "tbx/streams/memory_mapped_data_source.h"
+#include "tbx/streams/crc32_data_writer.h"
+#include "tbx/streams/chunked_memory_buffer.h"
+#include "tbx/streams/spill_buffer.h"
 
 #include "filters/filters.h"
 #include "filters/deflate_filter.h"
+#include "filters/lzma_filter.h"
+#include "filters/block_filter.h"
 
 #include "tbx/hash/hash.h"
 #include "crypto/crypto.h"
 
 #include "box/archive.h"
+#include "box/archive_builder.h"
+#include "box/similarity.h"
 
 #include "test/test_support.h"
 
 #include <random>
+#include <set>
+#include <unordered_set>
+#include <mutex>
 
 TEST_CASE("path", "[base]") {
   SECTION("initializing") {
@@ -644,6 +655,139 @@ TEST_CASE("memory buffer", "[support]") {
 }
 
 #pragma mark streams
+TEST_CASE("chunked memory buffer", "[support]") {
+  constexpr size_t CHUNK = 64;
+  chunked_memory_buffer b(CHUNK);
+  
+  SECTION("write across chunks") {
+    constexpr size_t LEN = CHUNK*3 + 17;
+    WRITE_RANDOM_DATA(b, temp, LEN);
+    
+    REQUIRE(b.size() == LEN);
+    REQUIRE(b.position() == LEN);
+    REQUIRE(b.chunkCount() == 4);
+    
+    b.rewind();
+    READ_DATA(b, result, LEN, read);
+    REQUIRE(read == LEN);
+    REQUIRE(memcmp(result, temp, LEN) == 0);
+    
+    memory_buffer sink;
+    b.writeTo(sink);
+    REQUIRE(sink == memory_buffer(temp, LEN));
+  }
+  
+  SECTION("reserve and patch through references") {
+    WRITE_RANDOM_DATA(b, temp, CHUNK - 3);
+    auto value = b.reserve<u64>();
+    auto array = b.reserveArray<u32>(40);
+    
+    REQUIRE(b.size() == CHUNK - 3 + sizeof(u64) + sizeof(u32)*40);
+    
+    value.write(0x0123456789ABCDEFULL);
+    for (u32 i = 0; i < array.count(); ++i)
+      array.write(i*i, i);
+    
+    b.seek(value, Seek::SET);
+    u64 readValue;
+    b.read(readValue);
+    REQUIRE(readValue == 0x0123456789ABCDEFULL);
+    
+    for (u32 i = 0; i < array.count(); ++i)
+    {
+      u32 readElement;
+      array.read(readElement, i);
+      REQUIRE(readElement == i*i);
+    }
+  }
+  
+  SECTION("seek past end leaves zeroes") {
+    WRITE_RANDOM_DATA(b, temp, 10);
+    b.seek(CHUNK*2, Seek::SET);
+    WRITE_RANDOM_DATA(b, more, 10);
+    
+    REQUIRE(b.size() == CHUNK*2 + 10);
+    
+    b.seek(10, Seek::SET);
+    READ_DATA(b, gap, CHUNK*2 - 10, read);
+    REQUIRE(read == CHUNK*2 - 10);
+    REQUIRE(std::all_of(gap, gap + read, [] (byte v) { return v == 0; }));
+  }
+  
+  SECTION("archive written to chunked buffer") {
+    ArchiveFactory::Data data;
+    for (size_t i = 0; i < 3; ++i)
+      data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+    data.streams.push_back({ { 0, 1 }, { new builders::deflate_builder(KB16) } });
+    data.streams.push_back({ { 2 }, { } });
+    
+    Archive archive = Archive::ofData(data);
+    
+    memory_buffer reference;
+    archive.write(reference);
+    
+    for (const auto& entry : data.entries)
+      static_cast<memory_buffer*>(entry.source)->rewind();
+    
+    chunked_memory_buffer output(1000);
+    archive.write(output);
+    
+    memory_buffer flattened;
+    output.writeTo(flattened);
+    REQUIRE(flattened == reference);
+    
+    testing::ArchiveTester::release(data);
+  }
+}
+
+TEST_CASE("spill buffer", "[support]") {
+  constexpr size_t CHUNK = 256;
+  
+  std::vector<byte> data(CHUNK*8 + 100);
+  randomize(data.data(), data.size());
+  
+  SECTION("everything fits in budget") {
+    memory_budget budget(CHUNK*16);
+    
+    {
+      spill_buffer buffer(budget, CHUNK);
+      buffer.write(data.data(), data.size());
+      
+      REQUIRE(buffer.size() == data.size());
+      REQUIRE(buffer.spilled() == 0);
+      REQUIRE(budget.available() == CHUNK*7);
+      
+      memory_buffer sink;
+      buffer.writeTo(sink, 100);
+      REQUIRE(sink == memory_buffer(data.data(), data.size()));
+    }
+    
+    REQUIRE(budget.available() == CHUNK*16);
+  }
+  
+  SECTION("data past budget is spilled") {
+    memory_budget budget(CHUNK*3);
+    spill_buffer buffer(budget, CHUNK);
+    
+    /* written in small pieces to cross chunk boundaries */
+    for (size_t i = 0; i < data.size(); i += 100)
+      buffer.write(data.data() + i, std::min(size_t(100), data.size() - i));
+    
+    REQUIRE(buffer.size() == data.size());
+    REQUIRE(buffer.inMemory() == CHUNK*3);
+    REQUIRE(buffer.spilled() == data.size() - CHUNK*3);
+    REQUIRE(budget.available() == 0);
+    
+    /* can be replayed more than once */
+    for (size_t i = 0; i < 2; ++i)
+    {
+      memory_buffer sink;
+      buffer.writeTo(sink, 100);
+      REQUIRE(sink == memory_buffer(data.data(), data.size()));
+    }
+  }
+}
+
 TEST_CASE("basic", "[stream]") {
   SECTION("single pipe") {
     constexpr size_t LEN = 256;
@@ -962,6 +1106,28 @@ TEST_CASE("hash filters", "[filters]") {
     
     REQUIRE(value == filter.filter().get());
   }
+  
+  SECTION("multiple digests on parallel lanes") {
+    constexpr size_t LEN = KB64;
+    memory_buffer source;
+    
+    WRITE_RANDOM_DATA_AND_REWIND(source, test, LEN);
+    
+    unbuffered_source_filter<filters::multiple_digest_filter> serial(&source, true, true, true, false);
+    null_data_sink sink;
+    passthrough_pipe pipe(&serial, &sink, 1000);
+    pipe.process();
+    
+    source.rewind();
+    
+    unbuffered_source_filter<filters::multiple_digest_filter> parallel(&source, true, true, true, true);
+    passthrough_pipe ppipe(&parallel, &sink, 1000);
+    ppipe.process();
+    
+    REQUIRE(serial.filter().crc32() == parallel.filter().crc32());
+    REQUIRE(serial.filter().md5() == parallel.filter().md5());
+    REQUIRE(serial.filter().sha1() == parallel.filter().sha1());
+  }
 }
 
 TEST_CASE("misc filters", "[filters]") {
@@ -1159,6 +1325,159 @@ TEST_CASE("deflate", "[filters]") {
   }
 }
 
+TEST_CASE("lzma", "[filters]") {
+  constexpr size_t LEN = 1 << 18;
+  
+  std::unique_ptr<memory_buffer> source(testing::randomCompressibleDataSource(LEN));
+  
+  /* encoder threads split stream into blocks which store their sizes */
+  source_filter<compression::lzma_encoder> encoder(source.get(), KB16, options::LZMAEncoder{ 9, true, KB64 });
+  memory_buffer compressed;
+  passthrough_pipe pipe(&encoder, &compressed, 1000);
+  pipe.process();
+  
+  /* trailing data must be left untouched by decoders */
+  compressed.write((u32)0xDEADBEEF);
+  
+  SECTION("single threaded decoder") {
+    compressed.rewind();
+    
+    source_filter<compression::lzma_decoder> decoder(&compressed, KB16);
+    memory_buffer sink;
+    passthrough_pipe pipe2(&decoder, &sink, 1000);
+    pipe2.process();
+    
+    REQUIRE(sink == *source);
+  }
+  
+  options::LZMADecoder options = { 4, GB1 };
+  size_t parallelism = 0;
+  
+  SECTION("multithreaded decoder") { parallelism = LEN / KB64; }
+  SECTION("multithreaded decoder over memory limit") { options.memoryLimit = 1; parallelism = 1; }
+  SECTION("multithreaded decoder on stream without block sizes") {
+    /* streaming encoder doesn't know sizes of a block when writing its header */
+    lzma_stream stream = LZMA_STREAM_INIT;
+    REQUIRE(lzma_easy_encoder(&stream, 6, LZMA_CHECK_NONE) == LZMA_OK);
+    
+    compressed = memory_buffer(LEN * 2);
+    stream.next_in = source->raw();
+    stream.avail_in = source->size();
+    stream.next_out = compressed.raw();
+    stream.avail_out = compressed.capacity();
+    
+    REQUIRE(lzma_code(&stream, LZMA_FINISH) == LZMA_STREAM_END);
+    compressed.advance(stream.total_out);
+    compressed.seek(stream.total_out);
+    lzma_end(&stream);
+    
+    compressed.write((u32)0xDEADBEEF);
+    parallelism = 1;
+  }
+  
+  if (parallelism > 0)
+  {
+    compressed.rewind();
+    
+    compression::lzma_mt_decoder decoder(&compressed, KB16, options);
+    memory_buffer sink;
+    passthrough_pipe pipe2(&decoder, &sink, 1000);
+    pipe2.process();
+    
+    REQUIRE(sink == *source);
+    REQUIRE(decoder.parallelism() == parallelism);
+    
+    /* decoder of blocks stops right after stream footer */
+    if (parallelism > 1)
+    {
+      u32 trailer;
+      REQUIRE(compressed.read(&trailer, sizeof(u32), 1) == sizeof(u32));
+      REQUIRE(trailer == 0xDEADBEEF);
+    }
+  }
+}
+
+TEST_CASE("block compression", "[filters]") {
+  constexpr size_t BLOCK_SIZE = KB16;
+  
+  size_t length = 0;
+  
+  SECTION("multiple blocks with a short one") { length = BLOCK_SIZE*5 + 1234; }
+  SECTION("multiple of block size") { length = BLOCK_SIZE*4; }
+  SECTION("single short block") { length = 1000; }
+  SECTION("empty") { length = 0; }
+  
+  std::unique_ptr<memory_buffer> source(testing::randomCompressibleDataSource(length));
+  
+  for (size_t threads : { 1, 4 })
+  {
+    source->rewind();
+    
+    memory_buffer compressed;
+    compression::block_encoder<compression::lzma_encoder> encoder(source.get(), KB16, BLOCK_SIZE);
+    passthrough_pipe pipe(&encoder, &compressed, 1000);
+    pipe.process();
+    
+    /* trailing data must be left untouched by decoder */
+    compressed.write((u32)0xDEADBEEF);
+    compressed.rewind();
+    
+    memory_buffer sink;
+    compression::block_decoder<compression::lzma_decoder> decoder(&compressed, KB16, threads);
+    passthrough_pipe pipe2(&decoder, &sink, 1000);
+    pipe2.process();
+    
+    REQUIRE(sink == *source);
+    
+    /* decoder stops at terminating header, block index is left unread */
+    const size_t blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    REQUIRE(compressed.toRead() == blocks * sizeof(compression::block_index_entry) + sizeof(u64) + sizeof(u32));
+    
+    /* blocks before offset are skipped */
+    if (length > BLOCK_SIZE)
+    {
+      const size_t offset = BLOCK_SIZE + 100;
+      compressed.rewind();
+      
+      memory_buffer partial;
+      compression::block_decoder<compression::lzma_decoder> skipper(static_cast<data_source*>(&compressed), KB16, threads, offset);
+      passthrough_pipe pipe3(&skipper, &partial, 1000);
+      pipe3.process();
+      
+      REQUIRE(partial.size() == length - offset);
+      REQUIRE(std::equal(partial.raw(), partial.raw() + partial.size(), source->raw() + offset));
+      
+      /* with a seekable source first block is never read so corrupting it doesn't matter */
+      std::fill(compressed.raw(), compressed.raw() + sizeof(compression::block_header), 0xFF);
+      seekable_source_slice slice(&compressed, 0, compressed.size() - sizeof(u32));
+      
+      memory_buffer seeked;
+      compression::block_decoder<compression::lzma_decoder> seeker(&slice, KB16, threads, offset);
+      passthrough_pipe pipe6(&seeker, &seeked, 1000);
+      pipe6.process();
+      
+      REQUIRE(seeked == partial);
+    }
+    
+    /* same framing works with deflate */
+    source->rewind();
+    
+    memory_buffer deflated;
+    compression::block_encoder<compression::deflater_filter> deflater(source.get(), KB16, BLOCK_SIZE);
+    passthrough_pipe pipe4(&deflater, &deflated, 1000);
+    pipe4.process();
+    
+    deflated.rewind();
+    
+    memory_buffer inflated;
+    compression::block_decoder<compression::inflater_filter> inflater(&deflated, KB16, threads);
+    passthrough_pipe pipe5(&inflater, &inflated, 1000);
+    pipe5.process();
+    
+    REQUIRE(inflated == *source);
+  }
+}
+
 #pragma mark hashes/crypto
 TEST_CASE("crc32", "[checksums]") {
   SECTION("crc32-test1") {
@@ -1177,6 +1496,49 @@ TEST_CASE("crc32", "[checksums]") {
     hash::crc32_t crc = hash::crc32_digester::compute(testString.data(), testString.length());
     REQUIRE(crc == 0x6F8F714A);
   }
+  
+  SECTION("crc32 combine") {
+    std::string testString = "The quick brown fox jumps over the lazy dog";
+    
+    for (size_t split = 0; split <= testString.length(); ++split)
+    {
+      hash::crc32_t first = hash::crc32_digester::compute(testString.data(), split);
+      hash::crc32_t second = hash::crc32_digester::compute(testString.data() + split, testString.length() - split);
+      REQUIRE(hash::crc32_digester::combine(first, second, testString.length() - split) == 0x414FA339);
+    }
+  }
+}
+
+TEST_CASE("crc32 data writer", "[checksums]") {
+  constexpr size_t LEN = 1024;
+  constexpr size_t START = 16;
+  
+  memory_buffer buffer;
+  crc32_data_writer writer(buffer, START);
+  
+  WRITE_RANDOM_DATA(writer, data, LEN);
+  
+  SECTION("appended data") {
+  }
+  
+  SECTION("reserved and patched data") {
+    auto header = writer.reserve<u64>();
+    auto table = writer.reserveArray<u32>(32);
+    
+    WRITE_RANDOM_DATA(writer, more, LEN);
+    
+    header.write(0x1234567890ABCDEFULL);
+    for (size_t i = 0; i < table.count(); i += 2)
+      table.write(static_cast<u32>(testing::random(0xFFFFFFFF)), i);
+  }
+  
+  SECTION("data overwritten across start") {
+    writer.seek(START - 4, Seek::SET);
+    WRITE_RANDOM_DATA(writer, patch, 64);
+    writer.seek(0, Seek::END);
+  }
+  
+  REQUIRE(writer.get() == hash::crc32_digester::compute(buffer.raw() + START, buffer.size() - START));
 }
 
 TEST_CASE("md5", "[checksums]") {
@@ -1695,4 +2057,1285 @@ TEST_CASE("archive (single entry archive with filters)", "[box archive]") {
   testing::ArchiveTester::verify(data, verify, output);
  
   testing::ArchiveTester::release(data);
-}
\ No newline at end of file
+}
+
+TEST_CASE("archive written to file", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  SECTION("single entry") {
+    data.entries.push_back({ "entry.bin", testing::randomCompressibleDataSource(KB16) });
+    data.streams.push_back({ { 0 }, { } });
+  }
+  
+  SECTION("multiple entries through stream filters") {
+    for (size_t i = 0; i < 4; ++i)
+      data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomDataSource(testing::random(KB16) + 512) });
+    data.streams.push_back({ { 0, 1 }, { new builders::deflate_builder(KB16) } });
+    data.streams.push_back({ { 2, 3 }, { new builders::lzma_builder(KB16) } });
+  }
+  
+  const path filename = "archive-test.box";
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().checksum.calculateGlobalChecksum = true;
+  
+  {
+    file_data_writer output(filename);
+    archive.write(output);
+    
+    REQUIRE(output.size() == archive.header().fileLength);
+    REQUIRE(archive.isValidGlobalChecksum(output));
+  }
+  
+  memory_buffer output;
+  output.unserialize(file_handle(filename, file_mode::READING));
+  
+  Archive verify;
+  verify.read(output);
+  verify.options().bufferSize = KB16;
+  testing::ArchiveTester::verify(data, verify, output);
+  
+  testing::ArchiveTester::release(data);
+  FileSystem::i()->deleteFile(filename);
+}
+
+TEST_CASE("archive (multithreaded stream encoding)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 8; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  
+  data.streams.push_back({ { 0 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 1, 2 }, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 3 }, { } });
+  data.streams.push_back({ { 4, 5, 6 }, { new builders::xor_builder(KB16, "foobar"), new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 7 }, { new builders::lzma_builder(KB16) } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  /* serial output is used as reference, multithreaded output must be identical */
+  memory_buffer reference;
+  archive.write(reference);
+  
+  for (const auto& entry : data.entries)
+    static_cast<memory_buffer*>(entry.source)->rewind();
+  
+  archive.options().threads = 4;
+  archive.options().digest.parallel = true;
+  REQUIRE(archive.options().isMultithreaded());
+  
+  memory_buffer output;
+  archive.write(output);
+  
+  REQUIRE(output == reference);
+  
+  /* streams exceeding memory budget are spilled to disk while encoded */
+  for (const auto& entry : data.entries)
+    static_cast<memory_buffer*>(entry.source)->rewind();
+  
+  archive.options().memoryBudget = KB32;
+  
+  memory_buffer spilled;
+  archive.write(spilled);
+  
+  REQUIRE(spilled == reference);
+  
+  output.rewind();
+  
+  Archive verify;
+  verify.read(output);
+  verify.options().bufferSize = KB16;
+  testing::ArchiveTester::verify(data, verify, output);
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (multithreaded encoding with xdelta3)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  memory_buffer* base = testing::randomDataSource(KB64);
+  memory_buffer* patched = new memory_buffer(base->raw(), base->size());
+  for (size_t i = 0; i < 32; ++i)
+    patched->raw()[testing::random(KB64)] ^= 0xFF;
+  
+  data.entries.push_back({ "base.bin", base, { } });
+  data.entries.push_back({ "other.bin", testing::randomCompressibleDataSource(KB32) });
+  data.entries.push_back({ "patched.bin", patched, { new builders::xdelta3_builder(KB16, base, MB1, KB64) } });
+  data.streams.push_back({ { 0 }, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 1 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 2 }, { } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  memory_buffer reference;
+  archive.write(reference);
+  
+  for (const auto& entry : data.entries)
+    static_cast<memory_buffer*>(entry.source)->rewind();
+  
+  /* digest of the delta source is computed through a slice while other streams are encoded,
+     it's stored in the payload of the delta so a wrong digest makes output differ */
+  archive.options().threads = 2;
+  
+  memory_buffer output;
+  archive.write(output);
+  
+  REQUIRE(output == reference);
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (copy of unmodified streams)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 5; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  
+  data.streams.push_back({ { 0, 1 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 2 }, { } });
+  data.streams.push_back({ { 3, 4 }, { new builders::lzma_builder(KB16) } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  memory_buffer original;
+  archive.write(original);
+  
+  Archive source;
+  source.read(original);
+  source.options().bufferSize = KB16;
+  
+  REQUIRE(std::all_of(source.streams().begin(), source.streams().end(), [] (const ArchiveStream& stream) { return stream.hasOrigin(); }));
+  
+  SECTION("archive is rewritten identically") {
+    source.options().threads = 1 + testing::random(4);
+    
+    memory_buffer copy;
+    source.write(copy);
+    
+    REQUIRE(copy == original);
+    
+    Archive verify;
+    verify.read(copy);
+    verify.options().bufferSize = KB16;
+    testing::ArchiveTester::verify(data, verify, copy);
+  }
+  
+  SECTION("modified stream is not copied anymore") {
+    ArchiveStream stream(&source.streams()[0].binary(), source.streams()[0].payload().raw());
+    stream.setOrigin(&original);
+    REQUIRE(stream.hasOrigin());
+    
+    stream.addFilter(new builders::deflate_builder(KB16));
+    REQUIRE(!stream.hasOrigin());
+  }
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (append to existing archive)", "[box archive]") {
+  ArchiveFactory::Data data, appended, all;
+  
+  for (size_t i = 0; i < 4; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  data.streams.push_back({ { 0, 1 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 2, 3 }, { } });
+  
+  for (size_t i = 0; i < 3; ++i)
+    appended.entries.push_back({ fmt::sprintf("appended%lu.bin", i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  appended.streams.push_back({ { 0 }, { new builders::lzma_builder(KB16) } });
+  appended.streams.push_back({ { 1, 2 }, { new builders::deflate_builder(KB16) } });
+  
+  /* expected result is both archives with indices of appended entries shifted */
+  all.entries = data.entries;
+  all.entries.insert(all.entries.end(), appended.entries.begin(), appended.entries.end());
+  all.streams = data.streams;
+  for (auto stream : appended.streams)
+  {
+    for (auto& ref : stream.entries)
+      ref += static_cast<ArchiveEntry::ref>(data.entries.size());
+    all.streams.push_back(stream);
+  }
+  
+  memory_buffer buffer;
+  
+  Archive source = Archive::ofData(data);
+  source.options().checksum.calculateGlobalChecksum = true;
+  source.write(buffer);
+  
+  const size_t originalSize = buffer.size();
+  const std::vector<byte> original(buffer.raw(), buffer.raw() + originalSize);
+  
+  Archive archive;
+  archive.read(buffer);
+  archive.options().bufferSize = KB16;
+  archive.options().checksum.calculateGlobalChecksum = true;
+  archive.options().threads = 1 + testing::random(4);
+  archive.append(buffer, appended);
+  
+  /* existing data past the header is left untouched */
+  REQUIRE(buffer.size() > originalSize);
+  REQUIRE(std::equal(original.begin() + sizeof(box::Header), original.end(), buffer.raw() + sizeof(box::Header)));
+  REQUIRE(archive.header().fileLength == buffer.size());
+  REQUIRE(archive.isValidGlobalChecksum(buffer));
+  
+  /* appended archive is not compact so it's verified after being written again */
+  Archive reloaded;
+  reloaded.read(buffer);
+  reloaded.options().bufferSize = KB16;
+  REQUIRE(reloaded.isValidGlobalChecksum(buffer));
+  
+  memory_buffer compacted;
+  reloaded.write(compacted);
+  REQUIRE(compacted.size() < buffer.size());
+  
+  Archive verify;
+  verify.read(compacted);
+  verify.options().bufferSize = KB16;
+  testing::ArchiveTester::verify(all, verify, compacted);
+  
+  testing::ArchiveTester::release(data);
+  testing::ArchiveTester::release(appended);
+}
+
+TEST_CASE("archive (deduplicated entries)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  memory_buffer* first = testing::randomCompressibleDataSource(KB16);
+  memory_buffer* second = testing::randomDataSource(KB16);
+  
+  data.entries.push_back({ "first.bin", first });
+  data.entries.push_back({ "first-copy.bin", new memory_buffer(first->raw(), first->size()) });
+  data.entries.push_back({ "second.bin", second });
+  data.entries.push_back({ "second-copy.bin", new memory_buffer(second->raw(), second->size()) });
+  data.entries.push_back({ "other.bin", testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  
+  data.streams.push_back({ { 0, 1, 2 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 3 }, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 4 }, { } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().deduplicate = true;
+  
+  memory_buffer buffer;
+  archive.write(buffer);
+  
+  /* stream left empty by duplicates is removed */
+  REQUIRE(archive.streams().size() == 2);
+  REQUIRE(archive.entries()[1].binary().original == 0);
+  REQUIRE(archive.entries()[3].binary().original == 2);
+  REQUIRE(!archive.entries()[0].isDuplicate());
+  REQUIRE(!archive.entries()[2].isDuplicate());
+  REQUIRE(!archive.entries()[4].isDuplicate());
+  
+  Archive verify;
+  verify.read(buffer);
+  verify.options().bufferSize = KB16;
+  
+  REQUIRE(verify.streams().size() == 2);
+  REQUIRE(verify.streams()[0].entries() == std::vector<ArchiveEntry::ref>({ 0, 2 }));
+  REQUIRE(verify.streams()[1].entries() == std::vector<ArchiveEntry::ref>({ 4 }));
+  
+  for (size_t i = 0; i < data.entries.size(); ++i)
+  {
+    const ArchiveEntry& entry = verify.entries()[i];
+    const memory_buffer& original = *static_cast<memory_buffer*>(data.entries[i].source);
+    
+    REQUIRE(entry.name() == data.entries[i].name);
+    REQUIRE(entry.binary().digest.size == original.size());
+    REQUIRE(entry.binary().digest.sha1 == hash::sha1_digester::compute(original.raw(), original.size()));
+    
+    ArchiveReadHandle handle(buffer, verify, entry);
+    memory_buffer sink;
+    passthrough_pipe pipe(handle.source(true), &sink, KB16);
+    pipe.process();
+    
+    REQUIRE(sink == original);
+  }
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (format versions)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 4; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  data.streams.push_back({ { 0, 1 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 2, 3 }, { } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  memory_buffer output;
+  archive.write(output);
+  
+  Archive current;
+  current.read(output);
+  
+  REQUIRE(current.header().version == box::CURRENT_VERSION);
+  
+  auto setVersion = [&output] (box::version_t version) {
+    std::memcpy(output.raw() + offsetof(box::Header, version), &version, sizeof(version));
+  };
+  
+  SECTION("version 1 entry records are read without original") {
+    /* records are packed in place as version 1 wrote them */
+    const size_t legacy = offsetof(box::Entry, original);
+    byte* table = output.raw() + current.section(box::Section::ENTRY_TABLE)->offset;
+    for (size_t i = 0; i < data.entries.size(); ++i)
+      std::memmove(table + i * legacy, table + i * sizeof(box::Entry), legacy);
+    
+    setVersion(box::FIRST_VERSION);
+    
+    Archive verify;
+    verify.read(output);
+    verify.options().bufferSize = KB16;
+    
+    /* records were moved so global checksum doesn't match anymore, entries are extracted instead */
+    for (size_t i = 0; i < data.entries.size(); ++i)
+    {
+      const ArchiveEntry& entry = verify.entries()[i];
+      
+      REQUIRE(entry.name() == data.entries[i].name);
+      REQUIRE(!entry.isDuplicate());
+      
+      ArchiveReadHandle handle(output, verify, entry);
+      memory_buffer sink;
+      passthrough_pipe pipe(handle.source(true), &sink, KB16);
+      pipe.process();
+      
+      REQUIRE(sink == *static_cast<memory_buffer*>(data.entries[i].source));
+    }
+  }
+  
+  SECTION("unknown versions are rejected") {
+    for (box::version_t version : { box::version_t(0), box::CURRENT_VERSION + 1 })
+    {
+      setVersion(version);
+      
+      Archive verify;
+      REQUIRE_THROWS_AS(verify.read(output), exceptions::unserialization_exception);
+    }
+  }
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (pipelined stream encoding)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 6; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB32 + testing::random(KB32)) });
+  
+  SECTION("single solid stream") {
+    data.streams.push_back({ { 0, 1, 2, 3, 4, 5 }, { new builders::lzma_builder(KB16) } });
+  }
+  
+  SECTION("entry and stream filters") {
+    for (auto& entry : data.entries)
+      entry.filters.push_back(new builders::xor_builder(KB16, "foobar"));
+    
+    data.streams.push_back({ { 0, 1, 2 }, { new builders::deflate_builder(KB16) } });
+    data.streams.push_back({ { 3, 4, 5 }, { } });
+  }
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  memory_buffer reference;
+  archive.write(reference);
+  
+  for (const auto& entry : data.entries)
+    static_cast<memory_buffer*>(entry.source)->rewind();
+  
+  archive.options().pipelined = true;
+  
+  memory_buffer output;
+  archive.write(output);
+  
+  REQUIRE(output == reference);
+  
+  /* streams exceeding memory budget are spilled to disk while encoded */
+  for (const auto& entry : data.entries)
+    static_cast<memory_buffer*>(entry.source)->rewind();
+  
+  archive.options().memoryBudget = KB32;
+  
+  memory_buffer spilled;
+  archive.write(spilled);
+  
+  REQUIRE(spilled == reference);
+  
+  output.rewind();
+  
+  Archive verify;
+  verify.read(output);
+  verify.options().bufferSize = KB16;
+  testing::ArchiveTester::verify(data, verify, output);
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (seek points)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 6; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16) });
+  
+  data.streams.push_back({ { 0, 1, 2, 3 }, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 4, 5 }, { new builders::deflate_builder(KB16) } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  size_t expectedPoints[2] = { 0, 0 };
+  
+  SECTION("point at each entry") {
+    archive.options().seekInterval = 1;
+    expectedPoints[0] = 4;
+    expectedPoints[1] = 2;
+  }
+  
+  SECTION("point every two entries") {
+    archive.options().seekInterval = KB32;
+    expectedPoints[0] = 2;
+    expectedPoints[1] = 1;
+  }
+  
+  SECTION("pipelined") {
+    archive.options().seekInterval = KB32;
+    archive.options().pipelined = true;
+    expectedPoints[0] = 2;
+    expectedPoints[1] = 1;
+  }
+  
+  memory_buffer output;
+  archive.write(output);
+  
+  output.rewind();
+  
+  Archive verify;
+  verify.read(output);
+  verify.options().bufferSize = KB16;
+  
+  for (size_t i = 0; i < 2; ++i)
+  {
+    const ArchiveStream& stream = verify.streams()[i];
+    
+    REQUIRE(stream.isSeekable());
+    REQUIRE(stream.seekPoints().size() == expectedPoints[i]);
+    REQUIRE(stream.seekPoints()[0].indexInStream == 0);
+    REQUIRE(stream.seekPoints()[0].offset == 0);
+    REQUIRE(stream.seekPoints()[0].filteredOffset == 0);
+  }
+  
+  testing::ArchiveTester::verify(data, verify, output);
+  
+  /* streams copied verbatim keep their points */
+  memory_buffer copy;
+  verify.write(copy);
+  
+  copy.rewind();
+  
+  Archive verifyCopy;
+  verifyCopy.read(copy);
+  verifyCopy.options().bufferSize = KB16;
+  
+  REQUIRE(verifyCopy.streams()[0].seekPoints().size() == expectedPoints[0]);
+  REQUIRE(verifyCopy.streams()[1].seekPoints().size() == expectedPoints[1]);
+  testing::ArchiveTester::verify(data, verifyCopy, copy);
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (block compressed streams)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 6; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB32 + testing::random(KB32)) });
+  
+  data.streams.push_back({ { 0, 1 }, { new builders::lzma_builder(KB16, KB16) } });
+  data.streams.push_back({ { 2, 3 }, { new builders::deflate_builder(KB16, KB32) } });
+  
+  /* solid lzma stream is decoded in parallel by its own blocks */
+  data.streams.push_back({ { 4, 5 }, { new builders::lzma_builder(KB16) } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  memory_buffer output;
+  archive.write(output);
+  
+  output.rewind();
+  
+  /* blocks are decoded in parallel */
+  Archive verify;
+  verify.options().decoderThreads = 4;
+  verify.read(output);
+  verify.options().bufferSize = KB16;
+  
+  REQUIRE(verify.streams()[0].filters().mnemonic(false) == "lzma:block=16.0kiB");
+  REQUIRE(verify.streams()[1].filters().mnemonic(false) == "deflate:block=32.0kiB");
+  
+  testing::ArchiveTester::verify(data, verify, output);
+  
+  /* first block is entirely inside first entry so it's never read when reading second one, the block index is used to seek past it */
+  {
+    byte* block = output.raw() + verify.streams()[0].binary().offset;
+    compression::block_header header;
+    std::memcpy(&header, block, sizeof(header));
+    std::fill(block, block + sizeof(header) + header.compressedLength, 0xFF);
+    
+    const ArchiveEntry& entry = verify.entries()[1];
+    ArchiveReadHandle handle(output, verify, entry);
+    
+    memory_buffer sink;
+    passthrough_pipe pipe(handle.source(true), &sink, KB16);
+    pipe.process();
+    
+    REQUIRE(*((memory_buffer*)data.entries[1].source) == sink);
+  }
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (extraction)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 8; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  
+  memory_buffer* duplicated = static_cast<memory_buffer*>(data.entries[0].source);
+  data.entries.push_back({ "entry0-copy.bin", new memory_buffer(duplicated->raw(), duplicated->size()) });
+  
+  data.entries[5].filters.push_back(new builders::lzma_builder(KB16));
+  data.entries[6].filters.push_back(new builders::xor_builder(KB16, "foobar"));
+  
+  data.streams.push_back({ { 0, 1, 2, 3 }, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 4, 5, 8 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 6 }, { } });
+  data.streams.push_back({ { 7 }, { new builders::lzma_builder(KB16, KB16) } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  archive.options().deduplicate = true;
+  
+  SECTION("solid streams") { }
+  SECTION("streams with seek points") { archive.options().seekInterval = KB32; }
+  
+  memory_buffer output;
+  Archive verify;
+  testing::ArchiveTester::roundtrip(archive, output, verify);
+  verify.options().bufferSize = KB16;
+  
+  /* single reader */
+  testing::ArchiveTester::verifyExtraction(verify, output, data);
+  
+  /* streams are extracted concurrently with a reader each, every sink is still requested once */
+  verify.options().threads = 4;
+  
+  std::vector<memory_buffer> extracted(data.entries.size());
+  std::vector<size_t> requests(data.entries.size(), 0);
+  std::mutex lock;
+  
+  verify.extract(output, [&] (const ArchiveEntry& entry) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t index = &entry - verify.entries().data();
+    ++requests[index];
+    return std::unique_ptr<data_sink>(new testing::forwarding_sink(&extracted[index]));
+  }, [&output] () {
+    return std::unique_ptr<seekable_data_source>(new memory_buffer(output.raw(), output.size()));
+  });
+  
+  for (size_t i = 0; i < data.entries.size(); ++i)
+  {
+    REQUIRE(requests[i] == 1);
+    REQUIRE(extracted[i] == *static_cast<memory_buffer*>(data.entries[i].source));
+  }
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (stream reader)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  const std::vector<size_t> sizes = { KB16, 0, KB32, 5000, KB16, 0 };
+  for (size_t i = 0; i < sizes.size(); ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(sizes[i]) });
+  
+  data.streams.push_back({ { 0, 1, 2, 3, 4, 5 }, { new builders::lzma_builder(KB16) } });
+  
+  size_t seekInterval = 0;
+  
+  SECTION("solid stream") { }
+  SECTION("stream with seek points") { seekInterval = KB32; }
+  SECTION("entry filters") { data.entries[3].filters.push_back(new builders::xor_builder(KB16, "foobar")); }
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  archive.options().seekInterval = seekInterval;
+  
+  memory_buffer output;
+  Archive verify;
+  testing::ArchiveTester::roundtrip(archive, output, verify);
+  verify.options().bufferSize = KB16;
+  
+  const ArchiveStream& stream = verify.streams()[0];
+  
+  /* entries are split from a single decoding of the stream */
+  {
+    std::vector<memory_buffer> extracted(sizes.size());
+    ArchiveStreamReader reader(output, verify, stream);
+    
+    reader.extract([&] (const ArchiveEntry& entry) {
+      return std::unique_ptr<data_sink>(new testing::forwarding_sink(&extracted[&entry - verify.entries().data()]));
+    });
+    
+    for (size_t i = 0; i < sizes.size(); ++i)
+      REQUIRE(extracted[i] == *static_cast<memory_buffer*>(data.entries[i].source));
+  }
+  
+  /* entries which are not read or only partially read are skipped */
+  {
+    ArchiveStreamReader reader(output, verify, stream);
+    
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+      data_source* source = reader.next();
+      REQUIRE(source);
+      REQUIRE(&reader.entry() == &verify.entries()[i]);
+      
+      if (i == 2 || i == 5)
+      {
+        memory_buffer sink;
+        passthrough_pipe pipe(source, &sink, KB16);
+        pipe.process();
+        REQUIRE(sink == *static_cast<memory_buffer*>(data.entries[i].source));
+      }
+      else if (i == 3)
+      {
+        byte buffer[100];
+        while (source->read(buffer, sizeof(buffer)) == 0) ;
+      }
+    }
+    
+    REQUIRE(reader.next() == nullptr);
+  }
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (delta entry inside solid stream)", "[box archive]") {
+  for (size_t size : { KB16, KB256 })
+  {
+    ArchiveFactory::Data data;
+    
+    memory_buffer* base = testing::randomDataSource(size);
+    memory_buffer* patched = new memory_buffer(base->raw(), base->size());
+    for (size_t i = 0; i < 32; ++i)
+      patched->raw()[testing::random(static_cast<u32>(size))] ^= 0xFF;
+    
+    /* base is decoded while the second stream is being decoded from the same reader */
+    data.entries.push_back({ "base.bin", base, { } });
+    data.entries.push_back({ "other.bin", testing::randomCompressibleDataSource(KB32) });
+    data.entries.push_back({ "patched.bin", patched, { new builders::xdelta3_builder(KB16, base, MB1, size) } });
+    data.streams.push_back({ { 0 }, { new builders::deflate_builder(KB16) } });
+    data.streams.push_back({ { 1, 2 }, { new builders::deflate_builder(KB16) } });
+    
+    Archive archive = Archive::ofData(data);
+    archive.options().bufferSize = KB16;
+    
+    memory_buffer output;
+    Archive verify;
+    testing::ArchiveTester::roundtrip(archive, output, verify);
+    verify.options().bufferSize = KB16;
+    
+    testing::ArchiveTester::verifyExtraction(verify, output, data);
+    
+    testing::ArchiveTester::release(data);
+  }
+}
+
+TEST_CASE("archive (memory mapped source)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 6; ++i)
+    data.entries.push_back({ fmt::sprintf("folder/%s/entry%lu.bin", std::string(i * 40, 'a' + i), i), testing::randomCompressibleDataSource(KB16 + testing::random(KB16)) });
+  
+  data.entries[2].filters.push_back(new builders::xor_builder(KB16, "foobar"));
+  
+  data.streams.push_back({ { 0, 1, 2 }, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 3, 4 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 5 }, { } });
+  
+  const path filename = "archive-mapped-test.box";
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  {
+    file_data_writer output(filename);
+    archive.write(output);
+  }
+  
+  /* mapping must be released before file is deleted */
+  {
+    memory_mapped_data_source mapped(filename);
+    REQUIRE(mapped.size() == archive.header().fileLength);
+    REQUIRE(mapped.view(0, mapped.size()) != nullptr);
+    REQUIRE(mapped.view(mapped.size(), 1) == nullptr);
+    
+    /* tables are parsed in place from mapping or with bulk reads from a plain file and must match */
+    Archive fromMapping;
+    fromMapping.read(mapped);
+    fromMapping.options().bufferSize = KB16;
+    
+    file_data_source plain(filename);
+    Archive fromFile;
+    fromFile.read(plain);
+    
+    REQUIRE(fromMapping.entries().size() == data.entries.size());
+    REQUIRE(fromFile.entries().size() == data.entries.size());
+    REQUIRE(fromMapping.streams().size() == data.streams.size());
+    
+    for (size_t i = 0; i < data.entries.size(); ++i)
+    {
+      REQUIRE(fromMapping.entries()[i].name() == data.entries[i].name);
+      REQUIRE(fromFile.entries()[i].name() == data.entries[i].name);
+      REQUIRE(fromMapping.entries()[i].filters().size() == data.entries[i].filters.size());
+    }
+    
+    testing::ArchiveTester::verifyExtraction(fromMapping, mapped, data);
+    
+    /* tables are shared with the mapping and stay valid once the source is released */
+    Archive detached;
+    {
+      memory_mapped_data_source source(filename);
+      detached.read(source);
+    }
+    
+    for (size_t i = 0; i < data.entries.size(); ++i)
+    {
+      REQUIRE(detached.entries()[i].name() == data.entries[i].name);
+      REQUIRE(detached.entries()[i].binary().digest == fromFile.entries()[i].binary().digest);
+    }
+  }
+  
+  testing::ArchiveTester::release(data);
+  FileSystem::i()->deleteFile(filename);
+}
+
+TEST_CASE("archive (lazy entries)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 5; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(KB16) });
+  
+  data.entries[1].filters.push_back(new builders::xor_builder(KB16, "foobar"));
+  data.entries[3].filters.push_back(new builders::lzma_builder(KB16));
+  
+  data.streams.push_back({ { 0, 1, 2 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 3, 4 }, { } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  memory_buffer output;
+  Archive read;
+  read.options().lazyEntries = true;
+  testing::ArchiveTester::roundtrip(archive, output, read);
+  
+  /* entries don't depend on the archive they've been read into, which can be moved before they're loaded */
+  Archive verify = std::move(read);
+  verify.options().bufferSize = KB16;
+  
+  REQUIRE(verify.entries().size() == data.entries.size());
+  REQUIRE(verify.checkEntriesMappingToStreams());
+  
+  for (const ArchiveEntry& entry : verify.entries())
+    REQUIRE(!entry.isLoaded());
+  
+  /* only accessed entry is loaded */
+  const ArchiveEntry& entry = verify.entries()[3];
+  REQUIRE(entry.name() == "entry3.bin");
+  REQUIRE(entry.isLoaded());
+  REQUIRE(entry.filters().size() == 1);
+  REQUIRE(!verify.entries()[1].isLoaded());
+  
+  SECTION("extraction") {
+    testing::ArchiveTester::verifyExtraction(verify, output, data);
+  }
+  
+  SECTION("full verification") {
+    testing::ArchiveTester::verify(data, verify, output);
+  }
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (bulk table reads)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 64; ++i)
+  {
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomCompressibleDataSource(1024) });
+    if (i % 4 == 0)
+      data.entries.back().filters.push_back(new builders::xor_builder(KB16, "foobar"));
+  }
+  
+  data.streams.push_back({ { }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { }, { new builders::lzma_builder(KB16) } });
+  for (size_t i = 0; i < data.entries.size(); ++i)
+    data.streams[i % 2].entries.push_back(i);
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  archive.options().seekInterval = KB16;
+  
+  memory_buffer output;
+  archive.write(output);
+  
+  /* each table is read at once so amount of reads doesn't depend on amount of entries */
+  testing::counting_source source(&output);
+  Archive verify;
+  verify.read(source);
+  verify.options().bufferSize = KB16;
+  
+  REQUIRE(source.reads <= verify.sections().size() + 2);
+  
+  testing::ArchiveTester::verify(data, verify, output);
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (name index)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 40; ++i)
+    data.entries.push_back({ fmt::sprintf("folder%lu/entry%lu.bin", i % 3, i), testing::randomCompressibleDataSource(1024) });
+  
+  data.streams.push_back({ { }, { new builders::deflate_builder(KB16) } });
+  for (size_t i = 0; i < data.entries.size(); ++i)
+    data.streams[0].entries.push_back(i);
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  archive.options().nameIndex = true;
+  
+  memory_buffer output;
+  Archive verify;
+  verify.options().lazyEntries = true;
+  testing::ArchiveTester::roundtrip(archive, output, verify);
+  verify.options().bufferSize = KB16;
+  
+  REQUIRE(verify.section(box::Section::NAME_INDEX));
+  REQUIRE(verify.section(box::Section::NAME_INDEX)->count == 128);
+  REQUIRE(archive.sizeInfo().totalSize == output.size());
+  
+  /* lookup goes through the index and loads only the entry which is found */
+  const ArchiveEntry* entry = verify.find("folder1/entry22.bin");
+  REQUIRE(entry == &verify.entries()[22]);
+  REQUIRE(std::count_if(verify.entries().begin(), verify.entries().end(), [] (const ArchiveEntry& entry) { return entry.isLoaded(); }) == 1);
+  
+  REQUIRE(verify.find("folder1/entry23.bin") == nullptr);
+  REQUIRE(verify.find("") == nullptr);
+  
+  for (size_t i = 0; i < data.entries.size(); ++i)
+    REQUIRE(verify.find(data.entries[i].name) == &verify.entries()[i]);
+  
+  testing::ArchiveTester::verify(data, verify, output);
+  
+  /* renamed entry is found by its new name even if index still refers to the old one */
+  const_cast<ArchiveEntry&>(verify.entries()[7]).setName("renamed.bin");
+  REQUIRE(verify.find("renamed.bin") == &verify.entries()[7]);
+  REQUIRE(verify.find(data.entries[7].name) == nullptr);
+  
+  /* archive which hasn't been read has no index so entries are scanned */
+  REQUIRE(archive.find("folder2/entry5.bin") == &archive.entries()[5]);
+  REQUIRE(archive.find("folder2/entry6.bin") == nullptr);
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (digest index)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  for (size_t i = 0; i < 6; ++i)
+    data.entries.push_back({ fmt::sprintf("entry%lu.bin", i), testing::randomDataSource(KB64) });
+  
+  /* a copy of an entry and a patched one stored as delta against the original */
+  memory_buffer* base = static_cast<memory_buffer*>(data.entries[0].source);
+  data.entries.push_back({ "entry2-copy.bin", new memory_buffer(static_cast<memory_buffer*>(data.entries[2].source)->raw(), KB64) });
+  
+  memory_buffer* patched = new memory_buffer(base->raw(), base->size());
+  for (size_t i = 0; i < 32; ++i)
+    patched->raw()[testing::random(KB64)] ^= 0xFF;
+  data.entries.push_back({ "entry0-patched.bin", patched, { new builders::xdelta3_builder(KB16, base, MB1, KB64) } });
+  
+  data.streams.push_back({ { 0, 1, 2, 3 }, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 4, 5, 6 }, { new builders::deflate_builder(KB16) } });
+  data.streams.push_back({ { 7 }, { } });
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  archive.options().digestIndex = true;
+  
+  memory_buffer output;
+  Archive verify;
+  verify.options().lazyEntries = true;
+  testing::ArchiveTester::roundtrip(archive, output, verify);
+  verify.options().bufferSize = KB16;
+  
+  REQUIRE(verify.section(box::Section::DIGEST_INDEX));
+  REQUIRE(verify.section(box::Section::DIGEST_INDEX)->count == data.entries.size());
+  REQUIRE(archive.sizeInfo().totalSize == output.size());
+  
+  for (size_t i = 0; i < data.entries.size(); ++i)
+  {
+    const box::DigestInfo& digest = archive.entries()[i].binary().digest;
+    
+    auto byCrc = verify.findByDigest(digest.crc32);
+    auto bySha1 = verify.findByDigest(digest.sha1);
+    
+    REQUIRE(std::find(byCrc.begin(), byCrc.end(), i) != byCrc.end());
+    REQUIRE(std::find(bySha1.begin(), bySha1.end(), i) != bySha1.end());
+    REQUIRE(byCrc.size() == (i == 2 || i == 6 ? 2 : 1));
+    
+    /* matching by full digest returns first entry */
+    REQUIRE(verify.findByDigest(digest) == &verify.entries()[i == 6 ? 2 : i]);
+  }
+  
+  REQUIRE(verify.findByDigest(box::DigestInfo()) == nullptr);
+  
+  /* lookup needs only the records so no entry has been loaded */
+  REQUIRE(std::none_of(verify.entries().begin(), verify.entries().end(), [] (const ArchiveEntry& entry) { return entry.isLoaded(); }));
+  
+  /* delta entry finds its source through the index */
+  testing::ArchiveTester::verify(data, verify, output);
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (shared delta sources)", "[box archive]") {
+  ArchiveFactory::Data data;
+  
+  memory_buffer* base = testing::randomDataSource(KB64);
+  data.entries.push_back({ "base.bin", base, { new builders::lzma_builder(KB16) } });
+  data.streams.push_back({ { 0 }, { } });
+  
+  const size_t deltas = 4;
+  for (size_t i = 0; i < deltas; ++i)
+  {
+    memory_buffer* patched = new memory_buffer(base->raw(), base->size());
+    for (size_t j = 0; j < 16; ++j)
+      patched->raw()[testing::random(KB64)] ^= 0xFF;
+    
+    data.entries.push_back({ fmt::sprintf("variant%lu.bin", i), patched, { new builders::xdelta3_builder(KB16, base, MB1, KB64) } });
+    data.streams.push_back({ { static_cast<ArchiveEntry::ref>(i + 1) }, { } });
+  }
+  
+  Archive archive = Archive::ofData(data);
+  archive.options().bufferSize = KB16;
+  
+  memory_buffer output;
+  Archive verify;
+  testing::ArchiveTester::roundtrip(archive, output, verify);
+  verify.options().bufferSize = KB16;
+  
+  size_t expectedDecodes = 1;
+  
+  SECTION("base is decoded once") { }
+  SECTION("base is dropped when budget is exceeded") { verify.options().sourceCache = { 0, false }; expectedDecodes = deltas; }
+  SECTION("base is spilled when budget is exceeded") { verify.options().sourceCache = { 0, true }; }
+  
+  testing::ArchiveTester::verifyExtraction(verify, output, data);
+  
+  const decoded_source_cache& cache = verify.sourceCache();
+  REQUIRE(cache.decodes() == expectedDecodes);
+  REQUIRE(cache.inMemory() == (verify.options().sourceCache.budget > 0 ? KB64 : 0));
+  REQUIRE(cache.count() == (verify.options().sourceCache.spill || verify.options().sourceCache.budget > 0 ? 1 : 0));
+  
+  testing::ArchiveTester::release(data);
+}
+
+TEST_CASE("archive (paged delta sources)", "[box archive]") {
+  SECTION("paged source") {
+    const size_t pageSize = 4096;
+    memory_buffer* data = testing::randomDataSource(KB64 + 1000);
+    paged_decoded_source source(data->size(), pageSize, 4, [data] () {
+      return std::unique_ptr<data_source>(new memory_buffer(data->raw(), data->size(), false));
+    });
+    
+    byte buffer[KB8];
+    
+    /* reads spanning pages and the partial last page */
+    for (roff_t offset : { size_t(0), size_t(1000), pageSize * 3 + 17, KB64 - 100, KB8 })
+    {
+      source.seek(offset);
+      size_t amount = source.read(buffer, sizeof(buffer));
+      REQUIRE(amount == std::min(sizeof(buffer), data->size() - offset));
+      REQUIRE(std::equal(buffer, buffer + amount, data->raw() + offset));
+      REQUIRE(source.sizeInMemory() <= pageSize * 4);
+    }
+    
+    /* first read forward, the one at the end and the one before evicted pages restart decoding */
+    REQUIRE(source.restarts() == 1);
+    
+    source.seek(data->size());
+    REQUIRE(source.read(buffer, sizeof(buffer)) == END_OF_STREAM);
+    
+    delete data;
+  }
+  
+  SECTION("delta entry with paged base") {
+    ArchiveFactory::Data data;
+    
+    memory_buffer* base = testing::randomDataSource(KB256);
+    memory_buffer* patched = new memory_buffer(base->raw(), base->size());
+    for (size_t j = 0; j < 64; ++j)
+      patched->raw()[testing::random(KB256)] ^= 0xFF;
+    
+    data.entries.push_back({ "base.bin", base, { } });
+    data.entries.push_back({ "variant.bin", patched, { new builders::xdelta3_builder(KB16, base, MB1, KB16) } });
+    data.streams.push_back({ { 0 }, { new builders::lzma_builder(KB16) } });
+    data.streams.push_back({ { 1 }, { new builders::deflate_builder(KB16) } });
+    
+    Archive archive = Archive::ofData(data);
+    archive.options().bufferSize = KB16;
+    
+    memory_buffer output;
+    Archive verify;
+    testing::ArchiveTester::roundtrip(archive, output, verify);
+    verify.options().bufferSize = KB16;
+    verify.options().sourcePaging = { KB64, KB16, 4 };
+    
+    testing::ArchiveTester::verifyExtraction(verify, output, data);
+    
+    /* base has not been decoded whole through the cache */
+    REQUIRE(verify.sourceCache().decodes() == 0);
+    
+    testing::ArchiveTester::release(data);
+  }
+}
+
+TEST_CASE("similarity (sampled resemblance)", "[similarity]") {
+  memory_buffer* data = testing::randomDataSource(KB256);
+  memory_buffer* other = testing::randomDataSource(KB256);
+  
+  /* same data with a block inserted in the middle, chunks after it are found again at a shifted offset */
+  memory_buffer shifted(KB256 + 1000);
+  std::copy(data->raw(), data->raw() + KB64, shifted.raw());
+  std::fill(shifted.raw() + KB64, shifted.raw() + KB64 + 1000, 0x55);
+  std::copy(data->raw() + KB64, data->raw() + KB256, shifted.raw() + KB64 + 1000);
+  
+  const size_t averageChunk = similarity::sample::averageChunkFor(KB256);
+  REQUIRE(averageChunk == 256);
+  
+  auto a = similarity::sample::of(data->raw(), KB256, averageChunk);
+  auto b = similarity::sample::of(shifted.raw(), KB256 + 1000, averageChunk);
+  auto c = similarity::sample::of(other->raw(), KB256, averageChunk);
+  
+  REQUIRE(a.resemblance(a) == 1.0f);
+  REQUIRE(a.resemblance(b) > 0.9f);
+  REQUIRE(a.resemblance(b) == b.resemblance(a));
+  REQUIRE(a.resemblance(c) < 0.01f);
+  
+  /* minhash estimates are close to the exact resemblance */
+  auto sa = similarity::signature::of(a), sb = similarity::signature::of(b), sc = similarity::signature::of(c);
+  REQUIRE(std::abs(sa.resemblance(sb) - a.resemblance(b)) < 0.15f);
+  REQUIRE(sa.resemblance(sc) < 0.05f);
+  
+  auto clusters = similarity::cluster({ sa, sc, sb }, 0.5f);
+  REQUIRE(clusters == std::vector<std::vector<size_t>>({ { 0, 2 }, { 1 } }));
+  
+  delete data;
+  delete other;
+}
+
+TEST_CASE("archive builder (best delta base)", "[box archive builder]") {
+  ArchiveBuilder builder(CachePolicy(CachePolicy::Mode::ALWAYS, 0), KB64, KB64);
+  
+  /* a family of revisions of the same data and an unrelated source which makes a bad base */
+  memory_buffer* base = testing::randomDataSource(KB64);
+  
+  data_source_vector sources;
+  sources.emplace_back("unrelated.bin", testing::randomDataSource(KB64));
+  
+  for (size_t i = 0; i < 3; ++i)
+  {
+    memory_buffer* revision = new memory_buffer(base->raw(), base->size());
+    for (size_t j = 0; j < 16 * (i + 1); ++j)
+      revision->raw()[testing::random(KB64)] ^= 0xFF;
+    sources.emplace_back(fmt::sprintf("revision%lu.bin", i), revision);
+  }
+  
+  sources.emplace_back("base.bin", base);
+  
+  auto archiveSize = [] (Archive& archive) {
+    chunked_memory_buffer buffer;
+    archive.write(buffer);
+    return buffer.size();
+  };
+  
+  /* exhaustive serial search, ties are won by the first source */
+  size_t expectedSize = std::numeric_limits<size_t>::max();
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+    Archive archive = builder.buildSingleStreamBaseWithDeltasArchive(sources, i);
+    expectedSize = std::min(expectedSize, archiveSize(archive));
+  }
+  
+  memory_buffer output;
+  Archive verify;
+  
+  SECTION("all candidates") {
+    Archive archive = builder.buildBestSingleStreamDeltaArchive(sources);
+    testing::ArchiveTester::roundtrip(archive, output, verify);
+    REQUIRE(output.size() == expectedSize);
+  }
+  
+  SECTION("only most similar candidate") {
+    Archive archive = builder.buildBestSingleStreamDeltaArchive(sources, 1);
+    testing::ArchiveTester::roundtrip(archive, output, verify);
+    
+    /* unrelated source is ranked last so it's never chosen as base */
+    const ArchiveEntry& unrelated = archive.entries()[0];
+    REQUIRE(unrelated.filters().mnemonic(false).find("xdelta3") != std::string::npos);
+  }
+  
+  testing::ArchiveTester::verifyExtraction(verify, output, sources);
+}
+
+TEST_CASE("archive builder (clustered deltas)", "[box archive builder]") {
+  ArchiveBuilder builder(CachePolicy(CachePolicy::Mode::ALWAYS, 0), KB64, KB64);
+  
+  /* two families of revisions interleaved and an unrelated source which stays alone */
+  const size_t families = 2, revisions = 3;
+  std::vector<memory_buffer*> bases = { testing::randomDataSource(KB64), testing::randomDataSource(KB64) };
+  
+  data_source_vector sources;
+  for (size_t i = 0; i < revisions; ++i)
+    for (size_t f = 0; f < families; ++f)
+    {
+      memory_buffer* revision = new memory_buffer(bases[f]->raw(), bases[f]->size());
+      for (size_t j = 0; j < 8 * i; ++j)
+        revision->raw()[testing::random(KB64)] ^= 0xFF;
+      sources.emplace_back(fmt::sprintf("family%lu-rev%lu.bin", f, i), revision);
+    }
+  sources.emplace_back("unrelated.bin", testing::randomDataSource(KB64));
+  
+  for (memory_buffer* base : bases)
+    delete base;
+  
+  Archive archive = builder.buildClusteredDeltaArchive(sources);
+  
+  memory_buffer output;
+  Archive verify;
+  testing::ArchiveTester::roundtrip(archive, output, verify);
+  
+  /* each family has one compressed base and all other members are deltas against it */
+  for (size_t f = 0; f < families; ++f)
+  {
+    std::set<std::string> deltas;
+    size_t compressed = 0;
+    
+    for (size_t i = 0; i < revisions; ++i)
+    {
+      std::string mnemonic = archive.entries()[i * families + f].filters().mnemonic(false);
+      if (mnemonic.find("xdelta3") != std::string::npos)
+        deltas.insert(mnemonic);
+      else
+        ++compressed;
+    }
+    
+    REQUIRE(compressed == 1);
+    REQUIRE(deltas.size() == 1);
+  }
+  
+  REQUIRE(archive.entries().back().filters().mnemonic(false).find("xdelta3") == std::string::npos);
+  
+  testing::ArchiveTester::verifyExtraction(verify, output, sources);
+}
+
+TEST_CASE("archive (delta chains)", "[box archive builder]") {
+  SECTION("revisions are chained") {
+    ArchiveBuilder builder(CachePolicy(CachePolicy::Mode::ALWAYS, 0), KB64, KB64);
+    
+    /* each revision patches the previous one so it resembles it more than the older ones */
+    data_source_vector sources;
+    sources.emplace_back("rev0.bin", testing::randomDataSource(KB64));
+    
+    const size_t revisions = 4;
+    for (size_t i = 1; i < revisions; ++i)
+    {
+      const memory_buffer* previous = static_cast<memory_buffer*>(sources.back().source.get());
+      memory_buffer* revision = new memory_buffer(previous->raw(), previous->size());
+      for (size_t j = 0; j < 64; ++j)
+        revision->raw()[testing::random(KB64)] ^= 0xFF;
+      sources.emplace_back(fmt::sprintf("rev%lu.bin", i), revision);
+    }
+    
+    /* an identical copy resolves to the entry which doesn't depend on it */
+    const memory_buffer* first = static_cast<memory_buffer*>(sources.front().source.get());
+    sources.emplace_back("rev0-copy.bin", new memory_buffer(first->raw(), first->size()));
+    
+    Archive archive = builder.buildDeltaChainArchive(sources);
+    
+    memory_buffer output;
+    Archive verify;
+    testing::ArchiveTester::roundtrip(archive, output, verify);
+    
+    /* depth of the chain of sources of each entry */
+    std::unordered_set<box::DigestInfo, box::DigestInfo::hash> sourceDigests;
+    size_t maxDepth = 0;
+    
+    for (const ArchiveEntry& entry : verify.entries())
+    {
+      size_t depth = 0;
+      for (const ArchiveEntry* current = &entry; current->filters().sourceDigest(); ++depth)
+      {
+        sourceDigests.insert(*current->filters().sourceDigest());
+        current = verify.findSource(*current->filters().sourceDigest());
+        REQUIRE(current);
+        REQUIRE(depth < verify.entries().size());
+      }
+      maxDepth = std::max(maxDepth, depth);
+    }
+    
+    REQUIRE(maxDepth >= 2);
+    
+    testing::ArchiveTester::verifyExtraction(verify, output, sources);
+    
+    /* intermediate sources are decoded once however long the chains are */
+    REQUIRE(verify.sourceCache().decodes() == sourceDigests.size());
+  }
+  
+  SECTION("cyclic sources are rejected") {
+    ArchiveFactory::Data data;
+    
+    memory_buffer* a = testing::randomDataSource(KB16);
+    memory_buffer* b = new memory_buffer(a->raw(), a->size());
+    for (size_t j = 0; j < 16; ++j)
+      b->raw()[testing::random(KB16)] ^= 0xFF;
+    
+    data.entries.push_back({ "a.bin", a, { new builders::xdelta3_builder(KB16, b, MB1, KB16) } });
+    data.entries.push_back({ "b.bin", b, { new builders::xdelta3_builder(KB16, a, MB1, KB16) } });
+    data.streams.push_back({ { 0 }, { } });
+    data.streams.push_back({ { 1 }, { } });
+    
+    Archive archive = Archive::ofData(data);
+    archive.options().bufferSize = KB16;
+    
+    memory_buffer output;
+    Archive verify;
+    testing::ArchiveTester::roundtrip(archive, output, verify);
+    
+    REQUIRE(verify.findSource(verify.entries()[0].binary().digest) == nullptr);
+    
+    ArchiveReadHandle handle(output, verify, verify.entries()[0]);
+    REQUIRE_THROWS_AS(handle.source(true), exceptions::unserialization_exception);
+    
+    testing::ArchiveTester::release(data);
+  }
+}